@@ -19,7 +19,7 @@ endif()
 
 include_directories(${PGSQL_INCLUDE_DIR})
 
-HHVM_EXTENSION(pgsql pgsql.cpp pdo_pgsql_statement.cpp pdo_pgsql_connection.cpp pdo_pgsql.cpp)
+HHVM_EXTENSION(pgsql pgsql.cpp pgsql_connection_pool.cpp pgsql_async.cpp pgsql_deadline.cpp pgsql_types.cpp pdo_pgsql_statement.cpp pdo_pgsql_connection.cpp pdo_pgsql.cpp)
 HHVM_SYSTEMLIB(pgsql ext_pgsql.php)
 
 target_link_libraries(pgsql ${PGSQL_LIBRARY})
@@ -22,6 +22,15 @@ function pg_connect(string $connection_string, int $connection_type = 0): ?resou
 <<__Native>>
 function pg_pconnect(string $connection_string, int $connection_type = 0): ?resource;
 
+<<__Native>>
+function pg_pconnect_async(string $connection_string): Awaitable<?resource>;
+
+<<__Native>>
+function pg_pconnect_primary(string $cluster_name): ?resource;
+
+<<__Native>>
+function pg_pconnect_replica(string $cluster_name): ?resource;
+
 <<__Native>>
 function pg_connection_pool_stat(): ?Array;
 
@@ -44,10 +53,13 @@ function pg_connection_status(resource $connection): int;
 function pg_convert(resource $connection, string $table_name, array<mixed> $assoc_array, int $option): mixed;
 
 <<__Native>>
-function pg_copy_from(resource $connection, string $table_name, array<mixed> $rows, string $delimiter="\t", string $null_as="\n"): bool;
+function pg_copy_from(resource $connection, string $table_name, mixed $rows, string $delimiter="\t", string $null_as="\\N", int $flags = 0): bool;
+
+<<__Native>>
+function pg_copy_to(resource $connection, string $table_name, string $delimiter="\t", string $null_as="\\N"): mixed;
 
 <<__Native>>
-function pg_copy_to(resource $connection, string $table_name, string $delimiter="\t", string $null_as="\n"): mixed;
+function pg_copy_to_stream(resource $connection, string $source, ?resource $stream = null, string $options = ""): mixed;
 
 <<__Native>>
 function pg_dbname(resource $connection): ?string;
@@ -68,7 +80,10 @@ function pg_escape_literal(resource $connection, string $data): string;
 function pg_escape_string(resource $connection, string $data): string;
 
 <<__Native>>
-function pg_execute(resource $connection, string $stmtname, array<mixed> $params): ?resource;
+function pg_execute(resource $connection, string $stmtname, array<mixed> $params, int $timeout_ms = -1): ?resource;
+
+<<__Native>>
+function pg_execute_async(resource $connection, string $stmtname, array<mixed> $params): Awaitable<?resource>;
 
 function pg_exec(resource $connection, string $stmtname, array<mixed> $params): ?resource {
     return pg_execute($connection, $stmtname, $params);
@@ -194,6 +209,21 @@ function pg_parameter_status(resource $connection, string $param_name): mixed;
 <<__Native>>
 function pg_ping(resource $connection): bool;
 
+<<__Native>>
+function pg_pipeline_begin(resource $connection): bool;
+
+<<__Native>>
+function pg_pipeline_query(resource $connection, string $query, array $params = []): bool;
+
+<<__Native>>
+function pg_pipeline_execute(resource $connection, string $stmtname, array $params = []): bool;
+
+<<__Native>>
+function pg_pipeline_sync(resource $connection): ?array;
+
+<<__Native>>
+function pg_pipeline_end(resource $connection): bool;
+
 <<__Native>>
 function pg_port(resource $connection): mixed;
 
@@ -204,10 +234,16 @@ function pg_prepare(resource $connection, string $stmtname, string $query): ?res
 function pg_put_line(resource $connection, string $data): bool;
 
 <<__Native>>
-function pg_query_params(resource $connection, string $query, array<mixed> $params): ?resource;
+function pg_query_unbuffered(resource $connection, string $query, int $chunk_size = 0, int $timeout_ms = -1): ?resource;
 
 <<__Native>>
-function pg_query(resource $connection, string $query): ?resource;
+function pg_query_params(resource $connection, string $query, array<mixed> $params, int $timeout_ms = -1): ?resource;
+
+<<__Native>>
+function pg_query(resource $connection, string $query, int $timeout_ms = -1): ?resource;
+
+<<__Native>>
+function pg_query_async(resource $connection, string $query): Awaitable<?resource>;
 
 <<__Native>>
 function pg_result_error_field(resource $result, int $fieldcode): ?string;
@@ -239,6 +275,18 @@ function pg_set_client_encoding(resource $connection, string $encoding): int;
 <<__Native>>
 function pg_trace(string $pathname, string $mode, resource $connection): bool;
 
+<<__Native>>
+function pg_set_param_format(resource $connection, int $format): bool;
+
+<<__Native>>
+function pg_set_result_format(resource $connection, int $format): bool;
+
+<<__Native>>
+function pg_set_query_timeout(resource $connection, int $timeout_ms): bool;
+
+<<__Native>>
+function pg_set_typed_fetch(resource $connection, bool $enable, int $numeric_mode = 0): bool;
+
 <<__Native>>
 function pg_transaction_status(resource $connection): int;
 
@@ -251,3 +299,8 @@ function pg_untrace(resource $connection): bool;
 <<__Native>>
 function pg_version(resource $connection): ?array;
 
+<<__Native>>
+function pg_wait_notify(resource $connection, int $timeout_ms = -1, int $result_type = 3): mixed;
+
+<<__Native>>
+function pg_wait_result(resource $connection, int $timeout_ms = -1): bool;
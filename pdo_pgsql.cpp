@@ -50,6 +50,26 @@ static class PDOPGSQLExtension : public Extension {
             s_PGSQL_ATTR_DISABLE_PREPARES.get(),
             PDO_PGSQL_ATTR_DISABLE_PREPARES
         );
+        Native::registerClassConstant<KindOfInt64>(
+            s_PDO.get(),
+            s_PGSQL_ATTR_STATEMENT_CACHE_SIZE.get(),
+            PDO_PGSQL_ATTR_STATEMENT_CACHE_SIZE
+        );
+        Native::registerClassConstant<KindOfInt64>(
+            s_PDO.get(),
+            s_PGSQL_ATTR_CURSOR_WITHOUT_HOLD.get(),
+            PDO_PGSQL_ATTR_CURSOR_WITHOUT_HOLD
+        );
+        Native::registerClassConstant<KindOfInt64>(
+            s_PDO.get(),
+            s_PGSQL_ATTR_UNBUFFERED.get(),
+            PDO_PGSQL_ATTR_UNBUFFERED
+        );
+        Native::registerClassConstant<KindOfInt64>(
+            s_PDO.get(),
+            s_PGSQL_ATTR_QUERY_TIMEOUT.get(),
+            PDO_PGSQL_ATTR_QUERY_TIMEOUT
+        );
     }
 } s_pdopgsql_extension;
 }
@@ -17,10 +17,18 @@ String pdo_attr_strval(const Array& options, int opt, const char *def);
 enum {
     PDO_PGSQL_ATTR_DISABLE_NATIVE_PREPARED_STATEMENT = PDO_ATTR_DRIVER_SPECIFIC,
     PDO_PGSQL_ATTR_DISABLE_PREPARES,
+    PDO_PGSQL_ATTR_STATEMENT_CACHE_SIZE,
+    PDO_PGSQL_ATTR_CURSOR_WITHOUT_HOLD,
+    PDO_PGSQL_ATTR_UNBUFFERED,
+    PDO_PGSQL_ATTR_QUERY_TIMEOUT,
 };
 
 const StaticString
     s_PGSQL_ATTR_DISABLE_NATIVE_PREPARED_STATEMENT("PGSQL_ATTR_DISABLE_NATIVE_PREPARED_STATEMENT "),
-    s_PGSQL_ATTR_DISABLE_PREPARES("PGSQL_ATTR_DISABLE_PREPARES");
+    s_PGSQL_ATTR_DISABLE_PREPARES("PGSQL_ATTR_DISABLE_PREPARES"),
+    s_PGSQL_ATTR_STATEMENT_CACHE_SIZE("PGSQL_ATTR_STATEMENT_CACHE_SIZE"),
+    s_PGSQL_ATTR_CURSOR_WITHOUT_HOLD("PGSQL_ATTR_CURSOR_WITHOUT_HOLD"),
+    s_PGSQL_ATTR_UNBUFFERED("PGSQL_ATTR_UNBUFFERED"),
+    s_PGSQL_ATTR_QUERY_TIMEOUT("PGSQL_ATTR_QUERY_TIMEOUT");
 }
 #endif
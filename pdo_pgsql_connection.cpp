@@ -3,6 +3,8 @@
 #include "pdo_pgsql_statement.h"
 #include "pdo_pgsql_resource.h"
 #include "pdo_pgsql.h"
+#include "pgsql_connection_pool.h"
+#include "pgsql_deadline.h"
 #include "hphp/runtime/ext/stream/ext_stream.h"
 #include "hphp/runtime/vm/jit/translator-inline.h"
 #undef PACKAGE_VERSION // pg_config defines it
@@ -98,17 +100,56 @@ static int php_pdo_parse_data_source(const char *data_source,
 
 namespace HPHP {
 
-    PDOPgSqlConnection::PDOPgSqlConnection() : m_server(nullptr), pgoid(InvalidOid) {
+    PDOPgSqlConnection::PDOPgSqlConnection() : m_server(nullptr), m_pool(nullptr), pgoid(InvalidOid),
+        m_serverStatements(false),
+        m_prefetch(DefaultPrefetch), m_cursor_without_hold(false), m_unbuffered(0),
+        m_queryTimeout(PGSQLQueryDeadline::DefaultTimeoutMs),
+        m_stmtCacheSize(DefaultStatementCacheSize) {
     }
 
     PDOPgSqlConnection::~PDOPgSqlConnection(){
-        if(m_server){
+        releaseServer();
+    }
+
+    // Returns a pooled connection to its pool, or closes a private one
+    void PDOPgSqlConnection::releaseServer(){
+        if(!m_server){
+            return;
+        }
+
+        m_requestDeadline.Disarm();
+
+        // Don't let a statement outlive the request that ran it
+        if(m_server->transactionStatus() == PQTRANS_ACTIVE){
+            m_server->cancel();
+        }
+
+        if(m_pool){
+            m_stmtCache.clear();
+            m_stmtCacheIndex.clear();
+            m_stmtsToDeallocate.clear();
+
+            // The cleaner drains what's left and, once it has rolled back,
+            // drops this checkout's statements and cursors before the
+            // connection is reused
+            m_pool->Release(*m_server, m_serverStatements);
+            m_serverStatements = false;
+            m_pool = nullptr;
+        } else {
             delete m_server;
         }
+
+        m_server = nullptr;
     }
 
     bool PDOPgSqlConnection::create(const Array &options){
         long connect_timeout = pdo_attr_lval(options, PDO_ATTR_TIMEOUT, 30);
+        long stmt_cache_size = pdo_attr_lval(options, PDO_PGSQL_ATTR_STATEMENT_CACHE_SIZE, DefaultStatementCacheSize);
+        m_stmtCacheSize = stmt_cache_size > 0 ? stmt_cache_size : 0;
+        m_prefetch = pdo_attr_lval(options, PDO_ATTR_PREFETCH, DefaultPrefetch);
+        m_cursor_without_hold = pdo_attr_lval(options, PDO_PGSQL_ATTR_CURSOR_WITHOUT_HOLD, 0);
+        m_unbuffered = pdo_attr_lval(options, PDO_PGSQL_ATTR_UNBUFFERED, 0);
+        m_queryTimeout = pdo_attr_lval(options, PDO_PGSQL_ATTR_QUERY_TIMEOUT, PGSQLQueryDeadline::DefaultTimeoutMs);
         struct pdo_data_src_parser vars[] = {
         { "host", "localhost", 0 },
         { "port", "5432", 0 },
@@ -144,6 +185,11 @@ namespace HPHP {
         conninfo << username << "'";
         conninfo << " connect_timeout=" << connect_timeout;
 
+        if(is_persistent){
+            m_conninfo = conninfo.str();
+            return checkoutServer();
+        }
+
         m_server = new PQ::Connection(conninfo.str());
 
         if(m_server->status() == CONNECTION_OK){
@@ -154,22 +200,52 @@ namespace HPHP {
         }
     }
 
-    bool PDOPgSqlConnection::closer(){
-        if(m_server){
-            delete m_server;
-            m_server = nullptr;
+    // Shares the pg_pconnect pools, so limits, stats and session cleanup on
+    // release are the same
+    bool PDOPgSqlConnection::checkoutServer(){
+        PGSQLConnectionPool& pool = s_connectionPoolContainer.GetPool(m_conninfo);
+        PGSQLCheckoutFailure failure;
+
+        m_server = pool.TryGetConnection(failure);
+
+        if(!m_server){
+            handleError(nullptr, PHP_PDO_PGSQL_CONNECTION_FAILURE_SQLSTATE, failure.m_message.c_str());
+            return false;
         }
 
+        m_pool = &pool;
+        return true;
+    }
+
+    bool PDOPgSqlConnection::closer(){
+        m_conninfo.clear();
+        releaseServer();
+
         return false;
     }
 
+    // Called at the end of every request that used a persistent connection,
+    // so an idle handle doesn't keep a pool connection checked out
+    void PDOPgSqlConnection::persistentShutdown(){
+        releaseServer();
+    }
+
     int64_t PDOPgSqlConnection::doer(const String& sql){
-        testConnection();
+        if(!testConnection()){
+            return -1;
+        }
 
         const char* query = sql.data();
 
+        PGSQLQueryDeadline deadline(*m_server, m_requestDeadline, m_queryTimeout);
+
         PQ::Result res = m_server->exec(query);
 
+        if(deadline.Cancelled(res)){
+            handleError(nullptr, PDO_PGSQL_TIMEOUT_SQLSTATE, "Query timed out");
+            return -1;
+        }
+
         if(!res){
             // I think this error should be handled in a different way perhaps?
             handleError(nullptr, "XX000", "Invalid result data");
@@ -195,7 +271,9 @@ namespace HPHP {
     }
 
     bool PDOPgSqlConnection::transactionCommand(const char* command){
-        testConnection();
+        if(!testConnection()){
+            return false;
+        }
 
         PQ::Result res = m_server->exec(command);
 
@@ -227,14 +305,23 @@ namespace HPHP {
         return transactionCommand("COMMIT");
     }
 
-    void PDOPgSqlConnection::testConnection(){
+    // Checks a persistent connection back out of its pool if a previous
+    // request released it
+    bool PDOPgSqlConnection::testConnection(){
+        if(!m_server && !m_conninfo.empty()){
+            return checkoutServer();
+        }
+
         if(!m_server){
-            handleError(nullptr, "08003", nullptr);
+            handleError(nullptr, "08003", "No connection to the server");
+            return false;
         }
+
+        return true;
     }
 
     bool PDOPgSqlConnection::checkLiveness(){
-        if(!m_server){
+        if(!testConnection()){
             return false;
         }
 
@@ -253,6 +340,10 @@ namespace HPHP {
     }
 
     bool PDOPgSqlConnection::quoter(const String& input, String &quoted, PDOParamType paramtype){
+        if(!testConnection()){
+            return false;
+        }
+
         switch(paramtype){
             case PDO_PARAM_LOB:
                 quoted = m_server->escapeByteA(input.data(), input.length());
@@ -287,7 +378,7 @@ namespace HPHP {
                 return empty_string();
             }
             return String((long)this->pgoid);
-        } else {
+        } else if(testConnection()) {
             const char *values[1];
             values[0] = name;
             PQ::Result res = m_server->exec("SELECT CURRVAL($1)", 1, values);
@@ -301,9 +392,15 @@ namespace HPHP {
                 return empty_string();
             }
         }
+
+        return empty_string();
     }
 
     int PDOPgSqlConnection::getAttribute(int64_t attr, Variant &value){
+        if(attr != PDO_ATTR_CLIENT_VERSION && !testConnection()){
+            return 0;
+        }
+
         switch(attr){
             case PDO_ATTR_CLIENT_VERSION:
                 value = String(PG_VERSION);
@@ -374,6 +471,22 @@ namespace HPHP {
             case PDO_ATTR_EMULATE_PREPARES:
                 m_emulate_prepare = value.toBoolean();
                 return true;
+            case PDO_ATTR_PREFETCH:
+                m_prefetch = value.toInt64();
+                return true;
+            case PDO_PGSQL_ATTR_CURSOR_WITHOUT_HOLD:
+                m_cursor_without_hold = value.toBoolean();
+                return true;
+            case PDO_PGSQL_ATTR_UNBUFFERED:
+                m_unbuffered = value.toInt64();
+                return true;
+            case PDO_PGSQL_ATTR_QUERY_TIMEOUT:
+                m_queryTimeout = value.toInt64();
+                return true;
+            case PDO_PGSQL_ATTR_STATEMENT_CACHE_SIZE:
+                m_stmtCacheSize = value.toInt64() > 0 ? value.toInt64() : 0;
+                evictStatements();
+                return true;
             default:
                 return false;
         }
@@ -384,6 +497,10 @@ namespace HPHP {
     }
 
     bool PDOPgSqlConnection::preparer(const String& sql, sp_PDOStatement *stmt, const Variant& options) {
+        if(!testConnection()){
+            return false;
+        }
+
         auto rsrc = newres<PDOPgSqlResource>(
             std::dynamic_pointer_cast<PDOPgSqlConnection>(shared_from_this()));
 
@@ -415,6 +532,99 @@ namespace HPHP {
         *emsg = std::string(msg);
     }
 
+    // Returns the name of an already prepared statement for sql, marking it
+    // in use, or nullptr if there is none.
+    const std::string* PDOPgSqlConnection::acquireStatement(const std::string& sql){
+        auto it = m_stmtCacheIndex.find(sql);
+        if(it == m_stmtCacheIndex.end()){
+            return nullptr;
+        }
+
+        m_stmtCache.splice(m_stmtCache.begin(), m_stmtCache, it->second);
+        it->second->users++;
+
+        return &it->second->name;
+    }
+
+    // Adopts a statement the caller has just prepared, marking it in use.
+    // Returns false if it can't be cached, in which case the caller still
+    // owns it.
+    bool PDOPgSqlConnection::cacheStatement(const std::string& sql, const std::string& name){
+        if(m_stmtCacheSize == 0 || m_stmtCacheIndex.count(sql)){
+            return false;
+        }
+
+        m_stmtCache.push_front(CachedStatement{sql, name, 1});
+        m_stmtCacheIndex[sql] = m_stmtCache.begin();
+
+        evictStatements();
+
+        return true;
+    }
+
+    void PDOPgSqlConnection::releaseStatement(const std::string& sql){
+        auto it = m_stmtCacheIndex.find(sql);
+        if(it != m_stmtCacheIndex.end() && it->second->users > 0){
+            it->second->users--;
+        }
+
+        evictStatements();
+    }
+
+    // Drops an entry the server no longer knows about
+    void PDOPgSqlConnection::forgetStatement(const std::string& sql){
+        auto it = m_stmtCacheIndex.find(sql);
+        if(it != m_stmtCacheIndex.end()){
+            m_stmtCache.erase(it->second);
+            m_stmtCacheIndex.erase(it);
+        }
+    }
+
+    void PDOPgSqlConnection::evictStatements(){
+        auto it = m_stmtCache.end();
+        while(m_stmtCache.size() > m_stmtCacheSize && it != m_stmtCache.begin()){
+            --it;
+            if(it->users > 0){
+                continue;
+            }
+
+            m_stmtsToDeallocate.push_back(it->name);
+            m_stmtCacheIndex.erase(it->sql);
+            it = m_stmtCache.erase(it);
+        }
+
+        if(m_stmtsToDeallocate.size() >= DeallocateBatchSize){
+            deallocateStatements();
+        }
+    }
+
+    // One round trip for the whole batch. Waits for the connection to be
+    // outside a transaction, as a failure would abort the caller's.
+    void PDOPgSqlConnection::deallocateStatements(){
+        if(m_stmtsToDeallocate.empty() || !m_server ||
+           m_server->transactionStatus() != PQTRANS_IDLE){
+            return;
+        }
+
+        std::string q;
+        for(auto& name : m_stmtsToDeallocate){
+            q += "DEALLOCATE " + name + ";";
+        }
+
+        PQ::Result res = m_server->exec(q);
+
+        if(!res || res.status() != PGRES_COMMAND_OK){
+            // The batch stops at the first failure, most likely a statement
+            // already deallocated behind the cache's back, so go through it
+            // again one at a time
+            for(auto& name : m_stmtsToDeallocate){
+                m_server->exec("DEALLOCATE " + name);
+            }
+        }
+
+        m_stmtsToDeallocate.clear();
+    }
+
     String PDOPgSqlConnection::pgsqlLOBCreate(){
         return String("ROFL LOB");
     }
@@ -3,10 +3,17 @@
 
 #include "hphp/runtime/ext/pdo_driver.h"
 #include "pq.h"
+#include "pgsql_deadline.h"
+
+#include <list>
+#include <unordered_map>
 
 #define PHP_PDO_PGSQL_CONNECTION_FAILURE_SQLSTATE "08006"
+// ODBC's "Timeout expired", for statements cancelled by their deadline
+#define PDO_PGSQL_TIMEOUT_SQLSTATE "HYT00"
 namespace HPHP {
     class PDOPgSqlStatement;
+    class PGSQLConnectionPool;
 
     class PDOPgSqlConnection : public PDOConnection {
         friend class PDOPgSqlStatement;
@@ -25,6 +32,7 @@ namespace HPHP {
         virtual bool rollback();
 
         virtual bool checkLiveness();
+        virtual void persistentShutdown();
 
         virtual bool quoter(const String& input, String &quoted, PDOParamType paramtype);
 
@@ -41,14 +49,62 @@ namespace HPHP {
 
     private:
         PQ::Connection* m_server;
+        // Set when m_server was checked out of a pool for a persistent connection
+        PGSQLConnectionPool* m_pool;
+        // Connection string of a persistent connection, which goes back to
+        // its pool at the end of every request and is checked out again on
+        // next use
+        std::string m_conninfo;
         Oid pgoid;
         ExecStatusType m_lastExec;
         std::string err_msg;
         bool m_emulate_prepare;
+        // Prepared statements or cursors were created on m_server since it
+        // was checked out
+        bool m_serverStatements;
+        // Defaults for scrollable cursors
+        long m_prefetch;
+        bool m_cursor_without_hold;
+        // Default row batch size for unbuffered statements, 0 to buffer
+        long m_unbuffered;
+        // Default milliseconds a statement may run, 0 for no limit
+        long m_queryTimeout;
+        // Disarmed in releaseServer(), before m_server can go to another
+        // request
+        PGSQLRequestDeadline m_requestDeadline;
         const char* sqlstate(PQ::Result& result);
         void handleError(PDOPgSqlStatement* stmt, const char* sqlState, const char* msg);
         bool transactionCommand(const char* command);
-        void testConnection();
+        bool testConnection();
+        bool checkoutServer();
+        void releaseServer();
+
+        // Server-side prepared statements, shared by every PDOStatement on
+        // this connection with the same rewritten SQL. Entries in use by a
+        // statement are never evicted; evicted ones are deallocated in
+        // batches.
+        struct CachedStatement {
+            std::string sql;
+            std::string name;
+            int users;
+        };
+        typedef std::list<CachedStatement> StatementList;
+
+        static const size_t DefaultStatementCacheSize = 256;
+        static const size_t DeallocateBatchSize = 16;
+        static const long DefaultPrefetch = 100;
+
+        StatementList m_stmtCache; // Most recently used first
+        std::unordered_map<std::string, StatementList::iterator> m_stmtCacheIndex;
+        std::vector<std::string> m_stmtsToDeallocate;
+        size_t m_stmtCacheSize;
+
+        const std::string* acquireStatement(const std::string& sql);
+        bool cacheStatement(const std::string& sql, const std::string& name);
+        void releaseStatement(const std::string& sql);
+        void forgetStatement(const std::string& sql);
+        void evictStatements();
+        void deallocateStatements();
 
     };
 }
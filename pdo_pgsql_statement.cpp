@@ -3,17 +3,22 @@
 #include "pdo_pgsql_connection.h"
 #include "pdo_pgsql.h"
 #include "pgsql.h"
+#include "pgsql_deadline.h"
+#include "hphp/runtime/ext/stream/ext_stream.h"
 #include <iomanip>
 
 #define STMT_HANDLE_ERROR(res) (*m_conn).handleError(this, (*m_conn).sqlstate(res), res.errorMessage())
 
 namespace HPHP {
 
-    unsigned long PDOPgSqlStatement::m_stmtNameCounter = 0;
-    unsigned long PDOPgSqlStatement::m_cursorNameCounter = 0;
+    std::atomic<unsigned long> PDOPgSqlStatement::m_stmtNameCounter(0);
+    std::atomic<unsigned long> PDOPgSqlStatement::m_cursorNameCounter(0);
     PDOPgSqlStatement::PDOPgSqlStatement(PDOPgSqlResource* conn, PQ::Connection* server)
         : m_conn(conn->conn()), m_server(server),
-          m_result(), m_isPrepared(false), m_current_row(0) {
+          m_result(), m_isPrepared(false), m_isCached(false), m_current_row(0),
+          m_windowSize(1), m_windowStart(0), m_windowIndex(-1), m_windowAtEnd(false),
+          m_cursorWithoutHold(false), m_cursorHeld(true), m_streamChunk(0), m_streaming(false),
+          m_queryTimeout(0) {
         this->dbh = dynamic_cast<PDOResource*>(conn);
     }
 
@@ -22,7 +27,22 @@ namespace HPHP {
     }
 
     void PDOPgSqlStatement::sweep(){
-        if(m_stmtName.size() > 0){
+        // The connection's server may already be back in its pool, or
+        // closed, in which case it's no longer ours to clean up
+        if(!m_conn || m_conn->m_server != m_server){
+            m_streaming = false;
+            m_isCached = false;
+            m_stmtName.clear();
+            m_cursorName.clear();
+        }
+
+        finishStream();
+
+        if(m_isCached){
+            if(m_conn){
+                m_conn->releaseStatement(m_resolvedQuery);
+            }
+        } else if(m_stmtName.size() > 0){
             if(m_isPrepared){
                 std::stringstream ss;
                 ss << "DEALLOCATE " << m_stmtName;
@@ -31,10 +51,7 @@ namespace HPHP {
         }
 
         if(m_cursorName.size() > 0){
-            // Do we need a check here maybe to see if we've actually got a cursor or not?
-            std::stringstream ss;
-            ss << "CLOSE " << m_cursorName;
-            m_server->exec(ss.str());
+            closeCursor();
         }
         m_server = nullptr;
         m_conn = nullptr;
@@ -46,7 +63,13 @@ namespace HPHP {
         bool scrollable = pdo_attr_lval(options, PDO_ATTR_CURSOR, PDO_CURSOR_FWDONLY) == PDO_CURSOR_SCROLL;
 
         if(scrollable){
-            m_cursorName = strprintf("pdo_crsr_%08x", ++m_cursorNameCounter);
+            m_cursorName = strprintf("pdo_crsr_%08lx", ++m_cursorNameCounter);
+            m_windowSize = pdo_attr_lval(options, PDO_ATTR_PREFETCH, m_conn->m_prefetch);
+            if(m_windowSize < 1){
+                m_windowSize = 1;
+            }
+            m_cursorWithoutHold = pdo_attr_lval(options, PDO_PGSQL_ATTR_CURSOR_WITHOUT_HOLD,
+                                                m_conn->m_cursor_without_hold);
             // Disable prepared statements
             supports_placeholders = PDO_PLACEHOLDER_NONE;
         } else if (
@@ -56,6 +79,12 @@ namespace HPHP {
             supports_placeholders = PDO_PLACEHOLDER_NONE;
         }
 
+        if(!scrollable){
+            m_streamChunk = pdo_attr_lval(options, PDO_PGSQL_ATTR_UNBUFFERED, m_conn->m_unbuffered);
+        }
+
+        m_queryTimeout = pdo_attr_lval(options, PDO_PGSQL_ATTR_QUERY_TIMEOUT, m_conn->m_queryTimeout);
+
         if(supports_placeholders != PDO_PLACEHOLDER_NONE && m_server->protocolVersion() > 2){
             named_rewrite_template = "$%d";
             String nsql;
@@ -72,30 +101,54 @@ namespace HPHP {
                 nsql = sql;
             }
 
-            m_stmtName = strprintf("pdo_stmt_%08x", ++m_stmtNameCounter);
-
             m_resolvedQuery = (std::string)nsql;
+
+            if(const std::string* cached = m_conn->acquireStatement(m_resolvedQuery)){
+                m_stmtName = *cached;
+                m_isPrepared = true;
+                m_isCached = true;
+            } else {
+                m_stmtName = strprintf("pdo_stmt_%08lx", ++m_stmtNameCounter);
+            }
         }
 
         return true;
     }
 
     bool PDOPgSqlStatement::executer(){
+        PGSQLQueryDeadline deadline(*m_server, m_conn->m_requestDeadline, m_queryTimeout);
+
+        if(execute()){
+            return true;
+        }
+
+        // Report the cancel as a timeout, whichever query it hit
+        if(deadline.Cancelled(m_result)){
+            m_conn->handleError(this, PDO_PGSQL_TIMEOUT_SQLSTATE, "Query timed out");
+        }
+
+        return false;
+    }
+
+    bool PDOPgSqlStatement::execute(){
         ExecStatusType status;
+        finishStream();
         if(m_result){
             m_result = PQ::Result();
         }
         m_current_row = 0;
 
         if(m_cursorName.size() > 0){
-            if(m_isPrepared){
-                std::stringstream ss;
-                ss << "CLOSE " << m_cursorName;
-                m_result = m_server->exec(ss.str());
-            }
+            closeCursor();
+
+            // A cursor without HOLD lives only as long as the transaction,
+            // so it's only an option when there is one, but it spares the
+            // server materialising the whole result at commit
+            bool hold = !(m_cursorWithoutHold && m_server->transactionStatus() == PQTRANS_INTRANS);
 
             std::stringstream q;
-            q << "DECLARE " << m_cursorName << " SCROLL CURSOR WITH HOLD FOR " << active_query_string.data();
+            q << "DECLARE " << m_cursorName << " SCROLL CURSOR "
+              << (hold ? "WITH HOLD" : "WITHOUT HOLD") << " FOR " << active_query_string.data();
 
             m_result = m_server->exec(q.str());
 
@@ -107,12 +160,19 @@ namespace HPHP {
             }
 
             m_isPrepared = true;
+            m_cursorHeld = hold;
+            m_conn->m_serverStatements = true;
 
             q.str(std::string());
 
             // Fetch to be able to get total number of rows
             q << "FETCH FORWARD 0 FROM " << m_cursorName;
             m_result = m_server->exec(q.str());
+
+            // An empty window just before the first row
+            m_windowStart = 1;
+            m_windowIndex = -1;
+            m_windowAtEnd = false;
         } else if(m_stmtName.size() > 0) {
             if(!m_isPrepared){
 stmt_retry:
@@ -124,6 +184,8 @@ stmt_retry:
                     case PGRES_TUPLES_OK:
                         // It worked!
                         m_isPrepared = true;
+                        m_conn->m_serverStatements = true;
+                        m_isCached = m_conn->cacheStatement(m_resolvedQuery, m_stmtName);
                         break;
                     default:
                         // Read Zend implementation for this one. I am not sure if this applies to hhvm as well or not
@@ -156,14 +218,41 @@ stmt_retry:
                 return false;
             }
 
-            m_result = m_server->execPrepared(m_stmtName.c_str(), bound_params.size(), params.data(), param_lengths.data(), param_formats.data());
+            if(m_streamChunk > 0){
+                m_result = sendStreaming(&params);
+                if(!m_result){
+                    return false;
+                }
+            } else {
+                m_result = m_server->execPrepared(m_stmtName.c_str(), bound_params.size(), params.data(), param_lengths.data(), param_formats.data());
+            }
+
+            // Someone ran DEALLOCATE behind the cache's back
+            if(m_isCached && m_result.status() == PGRES_FATAL_ERROR &&
+               !strcmp(m_conn->sqlstate(m_result), "26000")){
+                m_conn->forgetStatement(m_resolvedQuery);
+                m_isCached = false;
+                m_isPrepared = false;
+                m_stmtName = strprintf("pdo_stmt_%08lx", ++m_stmtNameCounter);
+
+                // The failure has aborted any transaction we're in, so the
+                // statement can't be prepared again until it's rolled back
+                if(m_server->transactionStatus() != PQTRANS_INERROR){
+                    return execute();
+                }
+            }
+        } else if(m_streamChunk > 0) {
+            m_result = sendStreaming(nullptr);
+            if(!m_result){
+                return false;
+            }
         } else {
             m_result = m_server->exec(active_query_string.data());
         }
 
         status = m_result.status();
 
-        if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK){
+        if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK && !m_streaming){
             STMT_HANDLE_ERROR(m_result);
             return false;
         }
@@ -239,29 +328,151 @@ stmt_retry:
         return true;
     }
 
+    // Closes the cursor if it's still open. One declared WITHOUT HOLD went
+    // away with its transaction, and closing it in a later one would fail
+    // and abort that, so it's only closed if the server still has it.
+    void PDOPgSqlStatement::closeCursor(){
+        if(!m_isPrepared){
+            return;
+        }
+
+        m_isPrepared = false;
+
+        if(!m_cursorHeld){
+            if(m_server->transactionStatus() != PQTRANS_INTRANS){
+                return;
+            }
+
+            const char* values[1] = { m_cursorName.c_str() };
+            PQ::Result res = m_server->exec("SELECT 1 FROM pg_cursors WHERE name = $1", 1, values);
+            if(!res || res.status() != PGRES_TUPLES_OK || res.numTuples() == 0){
+                return;
+            }
+        }
+
+        m_server->exec("CLOSE " + m_cursorName);
+    }
+
+    // Replaces the window with the rows returned by q, which start at cursor
+    // position `start` (0 if unknown), and moves to row `index` of it.
+    bool PDOPgSqlStatement::fetchWindow(const std::string& q, long start, long index){
+        m_result = m_server->exec(q);
+        ExecStatusType status = m_result.status();
+
+        if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK){
+            STMT_HANDLE_ERROR(m_result);
+            m_result = PQ::Result();
+            m_windowStart = 0;
+            return false;
+        }
+
+        long count = m_result.numTuples();
+
+        m_windowStart = start;
+        m_windowIndex = index;
+        m_windowAtEnd = count < m_windowSize;
+
+        if(index < 0 || index >= count){
+            return false;
+        }
+
+        m_current_row = index + 1;
+        return true;
+    }
+
     bool PDOPgSqlStatement::fetcher(PDOFetchOrientation ori, long offset){
         if(m_cursorName.size() > 0){
-            bool oriOk;
-            std::string oriStr = oriToStr(ori, offset, oriOk);
-            if(!oriOk){
-                return false;
-            }
-            std::string q = strprintf("FETCH %s FROM %s", oriStr.c_str(), m_cursorName.c_str());
+            long count = m_result ? m_result.numTuples() : 0;
 
-            m_result = m_server->exec(q);
-            ExecStatusType status = m_result.status();
+            // Where the requested row falls relative to the window
+            long index;
+            bool known = true;
 
-            if(status != PGRES_COMMAND_OK && status != PGRES_TUPLES_OK){
-                STMT_HANDLE_ERROR(m_result);
-                return false;
+            switch(ori){
+                case PDO_FETCH_ORI_NEXT:
+                    index = m_windowIndex + 1;
+                    break;
+                case PDO_FETCH_ORI_PRIOR:
+                    index = m_windowIndex - 1;
+                    break;
+                case PDO_FETCH_ORI_REL:
+                    index = m_windowIndex + offset;
+                    break;
+                case PDO_FETCH_ORI_FIRST:
+                    known = m_windowStart > 0;
+                    index = 1 - m_windowStart;
+                    break;
+                case PDO_FETCH_ORI_ABS:
+                    known = m_windowStart > 0 && offset > 0;
+                    index = offset - m_windowStart;
+                    break;
+                default:
+                    known = false;
+                    index = 0;
+                    break;
             }
 
-            if(m_result.numTuples()){
-                m_current_row = 1;
+            if(known && index >= 0 && index < count){
+                m_windowIndex = index;
+                m_current_row = index + 1;
                 return true;
+            }
+
+            if(ori == PDO_FETCH_ORI_NEXT && index >= count){
+                if(m_windowAtEnd){
+                    m_windowIndex = count;
+                    return false;
+                }
+
+                // The server cursor sits on the window's last row
+                return fetchWindow(
+                    strprintf("FETCH FORWARD %ld FROM %s", m_windowSize, m_cursorName.c_str()),
+                    m_windowStart > 0 ? m_windowStart + count : 0,
+                    0);
+            }
+
+            if(known && m_windowStart > 0){
+                // Move to just before the row and fill a window from there,
+                // in one round trip
+                long target = m_windowStart + index;
+                long before = target > 1 ? target - 1 : 0;
+
+                return fetchWindow(
+                    strprintf("MOVE ABSOLUTE %ld IN %s; FETCH FORWARD %ld FROM %s",
+                              before, m_cursorName.c_str(), m_windowSize, m_cursorName.c_str()),
+                    before + 1,
+                    target - (before + 1));
+            }
+
+            // The position is relative to the end, or the window's position
+            // isn't known; fetch just the one row
+            std::string q;
+            if(known){
+                // Relative to the server cursor, which is past the window's
+                // last row only if the window reaches the end
+                long serverIndex = m_windowAtEnd ? count : count - 1;
+                q = strprintf("FETCH RELATIVE %ld FROM %s", index - serverIndex, m_cursorName.c_str());
             } else {
+                bool oriOk;
+                std::string oriStr = oriToStr(ori, offset, oriOk);
+                if(!oriOk){
+                    return false;
+                }
+                q = strprintf("FETCH %s FROM %s", oriStr.c_str(), m_cursorName.c_str());
+            }
+
+            bool found = fetchWindow(q, 0, 0);
+
+            // A single row says nothing about what follows it
+            m_windowAtEnd = false;
+
+            return found;
+        } else if(m_streaming) {
+            if(m_current_row >= m_result.numTuples() && !nextChunk()){
                 return false;
             }
+            m_current_row++;
+            return true;
         } else {
             if(m_current_row < row_count){
                 m_current_row++;
@@ -406,27 +617,35 @@ stmt_retry:
                         int* param_fs = param_formats.data();
                         int* param_ls = param_lengths.data();
 
-                        if(PDO_PARAM_TYPE(param->param_type) == PDO_PARAM_LOB){
-                            // Todo, implement LOBs
-                            return false;
+                        Variant value = param->parameter;
+
+                        if(PDO_PARAM_TYPE(param->param_type) == PDO_PARAM_LOB && value.isResource()){
+                            // A stream, sent as its contents
+                            Variant contents = HHVM_FN(stream_get_contents)(value.toResource());
+                            if(!contents.isString()){
+                                m_conn->handleError(this, "HY000", "Could not read stream for LOB parameter");
+                                return false;
+                            }
+                            value = contents;
                         }
 
-                        if(PDO_PARAM_TYPE(param->param_type) == PDO_PARAM_NULL || param->parameter.isNull()){
+                        if(PDO_PARAM_TYPE(param->param_type) == PDO_PARAM_NULL || value.isNull()){
                             param_vals[param->paramno] = Variant(Variant::NullInit());
                             param_ls[param->paramno] = 0;
-                        } else if(param->parameter.isBoolean()){
+                        } else if(value.isBoolean()){
                             // Sadly we need to convert this to a 'real' pgsql boolean literal, ie a string
-                            param_vals[param->paramno] = param->parameter.asBooleanVal() ? Variant("t") : Variant("f");
+                            param_vals[param->paramno] = value.toBoolean() ? Variant("t") : Variant("f");
                             param_ls[param->paramno] = 1;
                             param_fs[param->paramno] = 0;
                         } else {
-                            String str = param->parameter.toString();
+                            String str = value.toString();
                             param_vals[param->paramno] = str;
                             param_ls[param->paramno] = str.length();
                             param_fs[param->paramno] = 0;
                         }
 
                         if(PDO_PARAM_TYPE(param->param_type) == PDO_PARAM_LOB){
+                            // Raw bytes for a bytea, with no escaping
                             param_ts[param->paramno] = 0;
                             param_fs[param->paramno] = 1;
                         } else {
@@ -449,7 +668,75 @@ stmt_retry:
         return true;
     }
 
+    // Sends the statement with its rows to be delivered m_streamChunk at a
+    // time, and returns the first result. A null result means the send
+    // failed and the error has been recorded.
+    PQ::Result PDOPgSqlStatement::sendStreaming(const std::vector<const char*>* params){
+        bool sent = params
+            ? m_server->sendQueryPrepared(m_stmtName.c_str(), params->size(), params->data(),
+                                          param_lengths.data(), param_formats.data())
+            : m_server->sendQuery(active_query_string.data());
+
+        if(!sent){
+            m_conn->handleError(this, "HY000", m_server->errorMessage());
+            return PQ::Result();
+        }
+
+        m_server->setStreaming(m_streamChunk);
+
+        PQ::Result res = m_server->result();
+
+        if(res.isPartial()){
+            m_streaming = true;
+        } else {
+            // No rows, or an error; either way it's all there is
+            while(PQ::Result extra = m_server->result()){}
+        }
+
+        return res;
+    }
+
+    // Replaces the current batch of rows with the next one. Returns false at
+    // the end of the result.
+    bool PDOPgSqlStatement::nextChunk(){
+        PQ::Result next = m_server->result();
+
+        if(next && next.isPartial()){
+            m_result = std::move(next);
+            m_current_row = 0;
+            row_count += m_result.numTuples();
+            return true;
+        }
+
+        m_streaming = false;
+
+        if(next && next.status() != PGRES_TUPLES_OK){
+            STMT_HANDLE_ERROR(next);
+        }
+
+        while(PQ::Result extra = m_server->result()){}
+
+        return false;
+    }
+
+    // Abandons the rest of an unbuffered result so the connection can be
+    // used again
+    void PDOPgSqlStatement::finishStream(){
+        if(!m_streaming){
+            return;
+        }
+
+        m_streaming = false;
+
+        if(m_server){
+            m_server->cancel();
+            while(PQ::Result extra = m_server->result()){}
+        }
+    }
+
     bool PDOPgSqlStatement::cursorCloser(){
+        finishStream();
+
         // For some reason, even without using a cursor, this is ok
         // This is what Zend does
         return true;
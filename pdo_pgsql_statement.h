@@ -6,6 +6,8 @@
 #include "pq.h"
 #include "stdarg.h"
 
+#include <atomic>
+
 #define BOOLOID     16
 #define BYTEAOID    17
 #define INT8OID     20
@@ -43,14 +45,16 @@ namespace HPHP {
     private:
         std::shared_ptr<PDOPgSqlConnection> m_conn;
         PQ::Connection* m_server;
-        static unsigned long m_stmtNameCounter;
-        static unsigned long m_cursorNameCounter;
+        static std::atomic<unsigned long> m_stmtNameCounter;
+        static std::atomic<unsigned long> m_cursorNameCounter;
         std::string m_stmtName;
         std::string m_resolvedQuery;
         std::string m_cursorName;
         std::string err_msg;
         PQ::Result m_result;
         bool m_isPrepared;
+        // m_stmtName belongs to the connection's statement cache
+        bool m_isCached;
         bool m_hasParams;
 
         std::vector<Oid> param_types;
@@ -62,6 +66,32 @@ namespace HPHP {
 
         long m_current_row;
 
+        // Scrollable cursors are read through a window of prefetched rows
+        // held in m_result
+        long m_windowSize;
+        long m_windowStart; // Cursor position of the first row, 0 if unknown
+        long m_windowIndex; // Current row within the window
+        bool m_windowAtEnd; // The window reaches the end of the result
+        bool m_cursorWithoutHold;
+        bool m_cursorHeld; // The open cursor was declared WITH HOLD
+
+        bool fetchWindow(const std::string& q, long start, long index);
+        void closeCursor();
+
+        // Unbuffered statements hold one batch of rows at a time
+        long m_streamChunk; // Rows per batch, 0 to buffer the whole result
+        bool m_streaming;
+
+        PQ::Result sendStreaming(const std::vector<const char*>* params);
+        bool nextChunk();
+        void finishStream();
+
+        // Milliseconds an execute may take before it is cancelled, 0 for
+        // no limit
+        long m_queryTimeout;
+
+        bool execute();
+
         std::string strprintf(const char* format, ...){
             va_list args;
             va_start (args, format);
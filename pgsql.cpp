@@ -1,108 +1,63 @@
 #include "pgsql.h"
+#include "pgsql_async.h"
+#include "pgsql_connection_pool.h"
+#include "pgsql_deadline.h"
+#include "pgsql_types.h"
 
 #include "hphp/runtime/base/zend-string.h"
 
 #include "hphp/runtime/base/runtime-option.h"
 #include "hphp/runtime/server/server-stats.h"
+#include "hphp/runtime/ext/asio/asio-external-thread-event.h"
+#include "hphp/runtime/ext/stream/ext_stream.h"
 #include "hphp/runtime/ext/string/ext_string.h"
 
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
 #define PGSQL_ASSOC 1
 #define PGSQL_NUM 2
 #define PGSQL_BOTH (PGSQL_ASSOC | PGSQL_NUM)
 #define PGSQL_STATUS_LONG 1
 #define PGSQL_STATUS_STRING 2
+#define PGSQL_FORMAT_TEXT 0
+#define PGSQL_FORMAT_BINARY 1
+#define PGSQL_COPY_BINARY 1
 
 #ifdef HACK_FRIENDLY
-#define FAIL_RETURN return null_variant
+#define FAIL_VALUE null_variant
 #else
-#define FAIL_RETURN return false
+#define FAIL_VALUE false
 #endif
 
+#define FAIL_RETURN return FAIL_VALUE
+
 namespace HPHP {
 
 namespace { // Anonymous namespace
 
-struct ScopeNonBlocking {
-    ScopeNonBlocking(PQ::Connection& conn, bool mode) :
-        m_conn(conn), m_mode(mode) {}
+// Shared between a connection and the async query running on it, so the
+// connection can wait until the poller thread is done with it
+struct PGSQLAsyncState {
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_done = false;
 
-    ~ScopeNonBlocking() {
-        m_conn.setNonBlocking(m_mode);
+    void Done() {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_done = true;
+        m_cond.notify_all();
     }
 
-    PQ::Connection& m_conn;
-    bool m_mode;
-};
-
-
-class PGSQLConnectionPool;
-
-static class PGSQLConnectionPoolContainer {
-private:
-    std::map<std::string, PGSQLConnectionPool*> m_pools;
-    Mutex m_lock;
-
-
-
-public:
-    PGSQLConnectionPoolContainer();
-    PGSQLConnectionPoolContainer(PGSQLConnectionPoolContainer const&);
-    void operator=(PGSQLConnectionPoolContainer const&);
-
-    ~PGSQLConnectionPoolContainer();
-
-    PGSQLConnectionPool& GetPool(const std::string);
-    std::vector<PGSQLConnectionPool *> &GetPools();
-
-} s_connectionPoolContainer;
-
-
-
-class PGSQLConnectionPool {
-private:
-    int m_maximumConnections;
-    Mutex m_lock;
-    std::string m_connectionString;
-    std::string m_cleanedConnectionString;
-    std::queue<PQ::Connection*> m_availableConnections;
-    std::vector<PQ::Connection*> m_connections;
-
-    long m_sweepedConnections = 0;
-    long m_openedConnections = 0;
-    long m_requestedConnections = 0;
-    long m_releasedConnections = 0;
-    long m_errors = 0;
-
-public:
-
-
-
-    long SweepedConnections() const { return m_sweepedConnections; }
-    long OpenedConnections() const { return m_openedConnections; }
-    long RequestedConnections() const { return m_requestedConnections; }
-    long ReleasedConnections() const { return m_releasedConnections; }
-    long Errors() const { return m_errors; }
-
-    int TotalConnectionsCount() const { return m_connections.size(); }
-    int FreeConnectionsCount() const { return m_availableConnections.size(); }
-
-    PGSQLConnectionPool(std::string connectionString, int maximumConnections = -1);
-    ~PGSQLConnectionPool();
-
-    PQ::Connection& GetConnection();
-    void Release(PQ::Connection& connection);
-
-    std::string GetConnectionString() const { return m_connectionString; }
-    std::string GetCleanedConnectionString() const { return m_cleanedConnectionString; }
-
-    void CloseAllConnections();
-    void CloseFreeConnections();
-    int MaximumConnections() const { return m_maximumConnections; }
-    void SweepConnection(PQ::Connection& connection);
+    void Wait() {
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_cond.wait(lock, [this] { return m_done; });
+    }
 };
 
-
-
 class PGSQL : public SweepableResourceData {
     DECLARE_RESOURCE_ALLOCATION(PGSQL);
 public:
@@ -116,8 +71,9 @@ public:
     static PGSQL *Get(const Variant& conn_id);
 
 public:
-    PGSQL(String conninfo);
+    PGSQL(String conninfo, bool async = false);
     PGSQL(PGSQLConnectionPool& connectionPool);
+    PGSQL(PGSQLConnectionPool& connectionPool, PQ::Connection& connection);
     ~PGSQL();
 
     void ReleaseConnection();
@@ -126,9 +82,24 @@ public:
     virtual const String& o_getClassNameHook() const { return s_class_name; }
     virtual bool isResource() const { return m_conn != nullptr; }
 
-    PQ::Connection &get() { return *m_conn; }
+    // Blocks until an asynchronous connection attempt, or an async query
+    // the poller thread is running, has finished
+    PQ::Connection &get() {
+        if (m_async) WaitAsync();
+        if (m_connecting) FinishConnect();
+        return *m_conn;
+    }
+
+    // Set while pg_query_async and friends own the connection
+    std::shared_ptr<PGSQLAsyncState> m_async;
+    void WaitAsync();
+
+    bool IsConnecting() const { return m_connecting; }
+    ConnStatusType PollConnect();
+    void FinishConnect();
 
     ScopeNonBlocking asNonBlocking() {
+        if (m_async) WaitAsync();
         auto mode = m_conn->isNonBlocking();
         return ScopeNonBlocking(*m_conn, mode);
     }
@@ -140,6 +111,11 @@ private:
 
     PGSQLConnectionPool* m_connectionPool = nullptr;
 
+    bool m_connecting = false;
+    PostgresPollingStatusType m_pollState = PGRES_POLLING_WRITING;
+
+    void StepConnect();
+
 public:
     std::string m_conn_string;
 
@@ -152,6 +128,69 @@ public:
 
     std::string m_last_notice;
     void SetupInformation();
+    void SetupNoticeProcessor();
+
+    // Formats pg_query_params and pg_execute use. Binary results are only
+    // asked for when every column type can be decoded, and binary
+    // parameters are encoded for the types the server expects, so each
+    // statement is described once and the answer remembered.
+    int m_resultFormat = PGSQL_FORMAT_TEXT;
+    int m_paramFormat = PGSQL_FORMAT_TEXT;
+
+    struct StatementInfo {
+        bool m_binaryResults;
+        std::vector<Oid> m_paramTypes;
+    };
+
+    const StatementInfo* DescribeQuery(const String& query, const Array& params);
+    const StatementInfo* DescribeStatement(const String& stmtname);
+    void ForgetStatement(const String& stmtname);
+
+    int ResultFormat(const StatementInfo* info) const {
+        return info && info->m_binaryResults ? m_resultFormat : PGSQL_FORMAT_TEXT;
+    }
+
+    const std::vector<Oid>* ParamTypes(const StatementInfo* info) const {
+        return info && m_paramFormat == PGSQL_FORMAT_BINARY ? &info->m_paramTypes : nullptr;
+    }
+
+private:
+    // Least recently used entries are evicted past MaxStatements
+    static const size_t MaxStatements = 1024;
+    struct CachedStatement {
+        std::string m_key;
+        StatementInfo m_info;
+    };
+    typedef std::list<CachedStatement> StatementList;
+    StatementList m_statementList; // Most recently used first
+    std::unordered_map<std::string, StatementList::iterator> m_statements;
+
+    const StatementInfo* FindStatement(const std::string& key);
+
+    bool WantsDescribe() const {
+        return m_resultFormat == PGSQL_FORMAT_BINARY || m_paramFormat == PGSQL_FORMAT_BINARY;
+    }
+
+    const StatementInfo* RememberStatement(std::string key, PQ::Result& desc);
+
+public:
+    // Whether results fetch ints, floats and bools as PHP values rather
+    // than strings
+    bool m_typedFetch = false;
+    PGSQLNumericMode m_numericMode = PGSQL_NUMERIC_STRING;
+
+    // Milliseconds pg_query, pg_query_params and pg_execute may take before
+    // they are cancelled, 0 for no limit. A negative per-call timeout means
+    // the connection's.
+    int m_queryTimeout = PGSQLQueryDeadline::DefaultTimeoutMs;
+
+    int QueryTimeout(int64_t timeout_ms) const {
+        return timeout_ms >= 0 ? (int)timeout_ms : m_queryTimeout;
+    }
+
+    // Disarmed in ReleaseConnection(), before the connection can go to
+    // another request
+    PGSQLRequestDeadline m_requestDeadline;
 };
 
 class PGSQLResult : public SweepableResourceData {
@@ -174,13 +213,21 @@ public:
     int getNumFields();
     int getNumRows();
 
+    // Rows of a streaming result arrive in batches and only the current
+    // batch is held, so rows are numbered from the start of the result but
+    // only those from firstRow() on can be read
+    void startStream();
+    bool seekRow(int row);
+    int firstRow() const { return m_chunkStart; }
+    int localRow(int row) const { return row - m_chunkStart; }
+
     bool convertFieldRow(const Variant& row, const Variant& field,
         int *out_row, int *out_field, const char *fn_name = nullptr);
 
     Variant fieldIsNull(const Variant& row, const Variant& field, const char *fn_name = nullptr);
 
     Variant getFieldVal(const Variant& row, const Variant& field, const char *fn_name = nullptr);
-    String getFieldVal(int row, int field, const char *fn_name = nullptr);
+    Variant getFieldVal(int row, int field, const char *fn_name = nullptr);
 
     PGSQL * getConn() { return m_conn; }
 
@@ -191,6 +238,14 @@ private:
     int m_num_fields;
     int m_num_rows;
     PGSQL * m_conn;
+
+    bool m_streaming = false;
+    int m_chunkStart = 0;
+
+    void finishStream();
+
+    // One per column, null where values stay strings
+    std::vector<PGSQLConverter> m_converters;
 };
 }
 
@@ -231,6 +286,11 @@ void PGSQL::SetupInformation()
     m_port = m_conn->port();
     m_options = m_conn->options();
 
+    SetupNoticeProcessor();
+}
+
+void PGSQL::SetupNoticeProcessor()
+{
     if (!PGSQL::IgnoreNotice) {
         m_conn->setNoticeProcessor(notice_processor, this);
     } else {
@@ -238,25 +298,73 @@ void PGSQL::SetupInformation()
     }
 }
 
-PGSQL::PGSQL(String conninfo)
+PGSQL::PGSQL(String conninfo, bool async)
     : m_conn_string(conninfo.data()), m_last_notice("") {
 
-    m_conn = new PQ::Connection(conninfo.data());
+    if (async) {
+        m_conn = PQ::Connection::start(conninfo.toCppString());
+    } else {
+        m_conn = new PQ::Connection(conninfo.data());
+    }
 
     if (RuntimeOption::EnableStats && RuntimeOption::EnableSQLStats) {
         ServerStats::Log("sql.conn", 1);
     }
 
     ConnStatusType st = m_conn->status();
-    if (m_conn && st == CONNECTION_OK) {
+    if (st == CONNECTION_BAD) {
+        m_conn->finish();
+    } else if (async) {
+        // Handshake continues in PollConnect()/FinishConnect()
+        m_connecting = true;
+    } else if (st == CONNECTION_OK) {
         // Load up the fixed information
         SetupInformation();
-    } else if (st == CONNECTION_BAD) {
-        m_conn->finish();
     }
 
 }
 
+// Advances the handshake by one PQconnectPoll step.
+void PGSQL::StepConnect()
+{
+    m_pollState = m_conn->connectPoll();
+
+    if (m_pollState == PGRES_POLLING_OK) {
+        m_connecting = false;
+        SetupInformation();
+    } else if (m_pollState == PGRES_POLLING_FAILED) {
+        m_connecting = false;
+    }
+}
+
+// Moves a pending asynchronous connection along as far as it can go without
+// blocking and returns the resulting status.
+ConnStatusType PGSQL::PollConnect()
+{
+    while (m_connecting &&
+           m_conn->waitSocket(m_pollState == PGRES_POLLING_READING,
+                              m_pollState == PGRES_POLLING_WRITING, 0)) {
+        StepConnect();
+    }
+
+    return m_conn->status();
+}
+
+void PGSQL::FinishConnect()
+{
+    while (m_connecting) {
+        if (!m_conn->waitSocket(m_pollState == PGRES_POLLING_READING,
+                                m_pollState == PGRES_POLLING_WRITING, -1)) {
+            // Without its socket the attempt can't go on; close it so the
+            // connection reports CONNECTION_BAD rather than looking usable
+            m_conn->finish();
+            m_connecting = false;
+            break;
+        }
+        StepConnect();
+    }
+}
+
 
 PGSQL::PGSQL(PGSQLConnectionPool &connectionPool)
     : m_conn_string(connectionPool.GetConnectionString()),
@@ -268,6 +376,17 @@ PGSQL::PGSQL(PGSQLConnectionPool &connectionPool)
     SetupInformation();
 }
 
+// Wraps a connection already checked out of connectionPool
+PGSQL::PGSQL(PGSQLConnectionPool &connectionPool, PQ::Connection &connection)
+    : m_conn_string(connectionPool.GetConnectionString()),
+      m_last_notice("")
+{
+    m_conn = &connection;
+    m_connectionPool = &connectionPool;
+
+    SetupInformation();
+}
+
 
 
 PGSQL::~PGSQL() {
@@ -279,16 +398,38 @@ void PGSQL::sweep() {
 }
 
 
+void PGSQL::WaitAsync()
+{
+    m_async->Wait();
+    m_async.reset();
+}
+
 void PGSQL::ReleaseConnection()
 {
     if (m_conn == nullptr) return;
 
+    if (m_async)
+    {
+        // Nobody is left to await the query
+        m_conn->cancel();
+        WaitAsync();
+    }
+
+    m_requestDeadline.Disarm();
+
     if (!IsConnectionPooled())
     {
+        // Closing the socket doesn't stop a running query; the server
+        // only notices once it has results to send
+        if (m_conn->transactionStatus() == PQTRANS_ACTIVE)
+            m_conn->cancel();
+
         m_conn->finish();
     }
     else
     {
+        // The cleaner thread cancels and drains a query still in flight
+        // before the connection is reused
         m_connectionPool->Release(*m_conn);
         m_connectionPool = nullptr;
         m_conn = nullptr;
@@ -296,6 +437,105 @@ void PGSQL::ReleaseConnection()
 
 }
 
+const PGSQL::StatementInfo* PGSQL::RememberStatement(std::string key, PQ::Result& desc) {
+    if (desc.status() != PGRES_COMMAND_OK) {
+        // Let the query itself report the problem
+        return nullptr;
+    }
+
+    StatementInfo info;
+    info.m_binaryResults = pgsql_binary_decodable(desc);
+    info.m_paramTypes.reserve(desc.numParams());
+    for (int i = 0; i < desc.numParams(); i++) {
+        info.m_paramTypes.push_back(desc.paramType(i));
+    }
+
+    if (m_statements.size() >= MaxStatements) {
+        m_statements.erase(m_statementList.back().m_key);
+        m_statementList.pop_back();
+    }
+
+    m_statementList.push_front(CachedStatement{key, std::move(info)});
+    m_statements.emplace(std::move(key), m_statementList.begin());
+
+    return &m_statementList.front().m_info;
+}
+
+const PGSQL::StatementInfo* PGSQL::FindStatement(const std::string& key) {
+    auto it = m_statements.find(key);
+    if (it == m_statements.end()) {
+        return nullptr;
+    }
+
+    m_statementList.splice(m_statementList.begin(), m_statementList, it->second);
+    return &it->second->m_info;
+}
+
+// Whether a parameter's encoding depends on the type the server expects.
+// Strings and nulls can go as text, unless the statement has been
+// described anyway.
+static bool wants_param_types(const Array& params) {
+    for (ArrayIter iter(params); iter; ++iter) {
+        const Variant& param = iter.secondRef();
+        if (param.isInteger() || param.isDouble() || param.isBoolean()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Describing a query means preparing it as the unnamed statement first,
+// so this costs two extra round trips the first time each query is seen.
+// They're only spent when the answer changes how the query is sent or
+// fetched.
+const PGSQL::StatementInfo* PGSQL::DescribeQuery(const String& query, const Array& params) {
+    if (!WantsDescribe()) {
+        return nullptr;
+    }
+
+    std::string key = "Q" + query.toCppString();
+
+    if (auto info = FindStatement(key)) {
+        return info;
+    }
+
+    if (m_resultFormat != PGSQL_FORMAT_BINARY && !wants_param_types(params)) {
+        return nullptr;
+    }
+
+    PQ::Result prep = get().prepare("", query.data(), 0);
+    if (prep.status() != PGRES_COMMAND_OK) {
+        return nullptr;
+    }
+
+    PQ::Result desc = get().describePrepared("");
+    return RememberStatement(std::move(key), desc);
+}
+
+const PGSQL::StatementInfo* PGSQL::DescribeStatement(const String& stmtname) {
+    if (!WantsDescribe()) {
+        return nullptr;
+    }
+
+    std::string key = "S" + stmtname.toCppString();
+
+    if (auto info = FindStatement(key)) {
+        return info;
+    }
+
+    PQ::Result desc = get().describePrepared(stmtname.data());
+    return RememberStatement(std::move(key), desc);
+}
+
+void PGSQL::ForgetStatement(const String& stmtname) {
+    auto it = m_statements.find("S" + stmtname.toCppString());
+    if (it != m_statements.end()) {
+        m_statementList.erase(it->second);
+        m_statements.erase(it);
+    }
+}
+
 PGSQLResult *PGSQLResult::Get(const Variant& result) {
     if (result.isNull()) {
         return nullptr;
@@ -309,21 +549,96 @@ PGSQLResult::PGSQLResult(PGSQL * conn, PQ::Result res)
     : m_current_row(0), m_res(std::move(res)),
       m_num_fields(-1), m_num_rows(-1), m_conn(conn) {
     m_conn->incRefCount();
+
+    int fields = m_res.numFields();
+    m_converters.resize(fields, nullptr);
+
+    for (int i = 0; i < fields; i++) {
+        if (m_res.format(i) == PGSQL_FORMAT_BINARY) {
+            m_converters[i] = pgsql_binary_converter(m_res.type(i));
+        } else if (m_conn->m_typedFetch) {
+            m_converters[i] = pgsql_text_converter(m_res.type(i), m_conn->m_numericMode);
+        }
+    }
 }
 
 void PGSQLResult::close() {
+    finishStream();
     m_res.clear();
 }
 
 PGSQLResult::~PGSQLResult() {
-    m_conn->decRefCount();
     close();
+    m_conn->decRefCount();
 }
 
 void PGSQLResult::sweep() {
+    // The connection may already be gone; a pooled one is drained by the
+    // pool if need be
+    m_streaming = false;
     close();
 }
 
+// Called on the first result of a query sent in streaming mode
+void PGSQLResult::startStream() {
+    if (m_res.isPartial()) {
+        m_streaming = true;
+        return;
+    }
+
+    // No rows; this was the final result already
+    while (PQ::Result extra = m_conn->get().result()) {}
+}
+
+// Makes `row` readable, reading ahead in a streaming result if need be.
+// Returns false if the row doesn't exist or has already been discarded.
+bool PGSQLResult::seekRow(int row) {
+    if (row < m_chunkStart) {
+        return false;
+    }
+
+    while (m_streaming && row >= m_chunkStart + m_res.numTuples()) {
+        int start = m_chunkStart + m_res.numTuples();
+        PQ::Result next = m_conn->get().result();
+
+        m_res = std::move(next);
+        m_chunkStart = start;
+
+        if (m_res && m_res.isPartial()) {
+            continue;
+        }
+
+        // The final result carries the outcome and no rows
+        m_streaming = false;
+
+        if (m_res && m_res.status() == PGRES_FATAL_ERROR) {
+            raise_warning("pg_query_unbuffered(): Query failed: %s", m_res.errorMessage());
+        }
+
+        while (PQ::Result extra = m_conn->get().result()) {}
+    }
+
+    return row < m_chunkStart + m_res.numTuples();
+}
+
+// Abandons the rest of a streaming result so the connection can be used
+// again.
+void PGSQLResult::finishStream() {
+    if (!m_streaming) {
+        return;
+    }
+
+    m_streaming = false;
+
+    if (!m_conn->isResource()) {
+        return;
+    }
+
+    PQ::Connection& conn = m_conn->get();
+    conn.cancel();
+    while (PQ::Result extra = conn.result()) {}
+}
+
 int PGSQLResult::getFieldNumber(const Variant& field) {
     int n;
     if (field.isNumeric(true)) {
@@ -345,8 +660,14 @@ int PGSQLResult::getNumFields() {
 }
 
 int PGSQLResult::getNumRows() {
+    // Rows received so far, until the stream ends. Once it has, the final
+    // result has no rows and m_chunkStart is the total.
+    if (m_streaming) {
+        return m_chunkStart + m_res.numTuples();
+    }
+
     if (m_num_rows == -1) {
-        m_num_rows = m_res.numTuples();
+        m_num_rows = m_chunkStart + m_res.numTuples();
     }
     return m_num_rows;
 }
@@ -383,7 +704,7 @@ bool PGSQLResult::convertFieldRow(const Variant& row, const Variant& field,
         return false;
     }
 
-    if (actual_row < 0 || actual_row >= getNumRows()) {
+    if (actual_row < 0 || !seekRow(actual_row)) {
         raise_warning("%s(): Row `%d` out of range", fn_name, actual_row);
         return false;
     }
@@ -397,7 +718,7 @@ bool PGSQLResult::convertFieldRow(const Variant& row, const Variant& field,
 Variant PGSQLResult::fieldIsNull(const Variant& row, const Variant& field, const char *fn_name) {
     int r, f;
     if (convertFieldRow(row, field, &r, &f, fn_name)) {
-        return m_res.fieldIsNull(r, f) ? 1 : 0;
+        return m_res.fieldIsNull(localRow(r), f) ? 1 : 0;
     }
 
     return false;
@@ -412,13 +733,19 @@ Variant PGSQLResult::getFieldVal(const Variant& row, const Variant& field, const
     return false;
 }
 
-String PGSQLResult::getFieldVal(int row, int field, const char *fn_name) {
+Variant PGSQLResult::getFieldVal(int row, int field, const char *fn_name) {
+    row = localRow(row);
+
     if (m_res.fieldIsNull(row, field)) {
         return null_string;
     } else {
         char * value = m_res.getValue(row, field);
         int length = m_res.getLength(row, field);
 
+        if (m_converters[field]) {
+            return m_converters[field](value, length);
+        }
+
         return String(value, length, CopyString);
     }
 }
@@ -426,268 +753,166 @@ String PGSQLResult::getFieldVal(int row, int field, const char *fn_name) {
 
 //////////////////////////////////////////////////////////////////////////////////
 
-PGSQLConnectionPool::PGSQLConnectionPool(std::string connectionString, int maximumConnections)
-    :m_maximumConnections(maximumConnections),
-     m_connectionString(connectionString),
-     m_availableConnections(),
-     m_connections()
-{
-
-}
-
-
-PGSQLConnectionPool::~PGSQLConnectionPool()
-{
-    CloseAllConnections();
-}
 
+// Simple RAII helper to convert an array to a
+// list of C strings to pass to pgsql functions. Needs
+// to be like this because string conversion may-or-may
+// not allocate and therefore needs to ensure that the
+// underlying data lasts long enough.
+//
+// Given the parameter types the server expects, bytea strings and ints,
+// floats and bools of matching types are sent in binary instead. bytea is
+// sent straight from the PHP string's buffer.
+struct CStringArray {
+    std::vector<String> m_strings;
+    std::vector<const char *> m_c_strs;
 
-PQ::Connection& PGSQLConnectionPool::GetConnection()
-{
-    Lock lock(m_lock);
+    // Only filled in when sending binary
+    const std::vector<Oid> *m_types = nullptr;
+    std::vector<int> m_lengths;
+    std::vector<int> m_formats;
+    std::vector<uint64_t> m_binary;
 
-    // 1) m_availableConnections
-    // 2) newconn, max 1
+public:
+    CStringArray(const Array& arr, const std::vector<Oid> *binaryTypes = nullptr) {
+        int size = arr.size();
 
-    m_requestedConnections++;
+        m_strings.reserve(size);
+        m_c_strs.reserve(size);
 
-    while (!m_availableConnections.empty())
-    {
-        PQ::Connection* pconn = m_availableConnections.front();
-        PQ::Connection& conn = *pconn;
-        m_availableConnections.pop();
+        // A count mismatch is left for the server to report
+        if (binaryTypes && (int)binaryTypes->size() == size) {
+            m_types = binaryTypes;
+            m_lengths.resize(size);
+            m_formats.resize(size);
+            m_binary.resize(size);
+        }
 
-        ConnStatusType st = conn.status();
-        if (conn && st == CONNECTION_OK)
-        {
-            return conn;
+        int i = 0;
+        for (ArrayIter iter(arr); iter; ++iter, ++i) {
+            const Variant &param = iter.secondRef();
+            if (param.isNull()) {
+                m_strings.push_back(null_string);
+                m_c_strs.push_back(nullptr);
+            } else if (!m_types || !addBinary(i, param)) {
+                m_strings.push_back(param.toString());
+                m_c_strs.push_back(m_strings.back().data());
+                if (m_types) m_lengths[i] = m_strings.back().size();
+            }
         }
-        else if (st == CONNECTION_BAD)
-        {
-            SweepConnection(conn);
+    }
 
-            conn.finish();
-        };
+    const char * const *data() {
+        return m_c_strs.data();
     }
 
-    if (RuntimeOption::EnableStats && RuntimeOption::EnableSQLStats) {
-        ServerStats::Log("sql.conn", 1);
+    const Oid *types() {
+        return m_types ? m_types->data() : nullptr;
     }
 
-    int maxConnections = MaximumConnections();
-    int connections = m_connections.size();
+    const int *lengths() {
+        return m_types ? m_lengths.data() : nullptr;
+    }
 
-    if (maxConnections > 0 && connections < maxConnections)
-        raise_error("The connection pool is full, cannot open new connection.");
+    const int *formats() {
+        return m_types ? m_formats.data() : nullptr;
+    }
 
-    PQ::Connection& conn = *(new PQ::Connection(GetConnectionString()));
+private:
+    bool addBinary(int i, const Variant& param) {
+        Oid type = (*m_types)[i];
 
-    ConnStatusType st = conn.status();
-    if (st == CONNECTION_OK)
-    {
-        m_openedConnections++;
-        m_connections.push_back(&conn);
-    }
-    else if (st == CONNECTION_BAD)
-    {
-        m_errors++;
+        if (type == PGSQL_BYTEAOID && param.isString()) {
+            m_strings.push_back(param.toString());
+            m_c_strs.push_back(m_strings.back().data());
+            m_lengths[i] = m_strings.back().size();
+        } else {
+            char *buf = reinterpret_cast<char *>(&m_binary[i]);
+            int length = pgsql_encode_binary(type, param, buf);
+            if (length < 0) {
+                return false;
+            }
 
-        conn.finish();
+            m_strings.push_back(null_string);
+            m_c_strs.push_back(buf);
+            m_lengths[i] = length;
+        }
 
-        raise_error("Getting connection from pool failed.");
+        m_formats[i] = PGSQL_FORMAT_BINARY;
+        return true;
     }
 
-    if (m_cleanedConnectionString == "")
-    {
-        m_cleanedConnectionString.append("host=");
-        m_cleanedConnectionString.append(conn.host());
-        m_cleanedConnectionString.append(" port=");
-        m_cleanedConnectionString.append(conn.port());
-        m_cleanedConnectionString.append(" user=");
-        m_cleanedConnectionString.append(conn.user());
-        m_cleanedConnectionString.append(" dbname=");
-        m_cleanedConnectionString.append(conn.db());
-    }
+};
 
-    return conn;
-}
+//////////////////// Connection functions /////////////////////////
 
-void PGSQLConnectionPool::SweepConnection(PQ::Connection& connection)
-{
-    auto p = std::find(m_connections.begin(), m_connections.end(), &connection);
+static Variant HHVM_FUNCTION(pg_connect, const String& connection_string, int connect_type /* = 0 */) {
+    PGSQL * pgsql = nullptr;
 
-    if (p != m_connections.end())
-        m_connections.erase(p);
+    pgsql = NEWRES(PGSQL)(connection_string);
 
-    m_sweepedConnections++;
+    if (!pgsql->get()) {
+        delete pgsql;
+        FAIL_RETURN;
+    }
+    return Resource(pgsql);
 }
 
-void PGSQLConnectionPool::Release(PQ::Connection& connection)
-{
-    Lock lock(m_lock);
 
-    m_releasedConnections++;
+static Variant HHVM_FUNCTION(pg_async_connect, const String& connection_string, int connect_type /* = 0 */) {
+    PGSQL * pgsql = nullptr;
 
-    ConnStatusType st = connection.status();
-    if (connection && st == CONNECTION_OK) {
+    pgsql = NEWRES(PGSQL)(connection_string, true);
 
-        m_availableConnections.push(&connection);
+    if (!pgsql->IsConnecting() && pgsql->get().status() != CONNECTION_OK) {
+        delete pgsql;
+        FAIL_RETURN;
+    }
+    return Resource(pgsql);
+}
 
-    } else if (st == CONNECTION_BAD) {
 
-        connection.finish();
-        SweepConnection(connection);
+static Variant HHVM_FUNCTION(pg_pconnect, const String& connection_string, int connect_type /* = 0 */) {
+    PGSQL * pgsql = nullptr;
 
+    PGSQLConnectionPool& pool = s_connectionPoolContainer.GetPool(connection_string.data(),
+                                                                  connection_string.size());
 
-    }
+    pgsql = NEWRES(PGSQL)(pool);
 
-
-}
-
-void PGSQLConnectionPool::CloseAllConnections()
-{
-    Lock lock(m_lock);
-
-    while (!m_availableConnections.empty())
-    {
-        PQ::Connection* pconn = m_availableConnections.front();
-        pconn->finish();
-
-        m_availableConnections.pop();
-    }
-
-    for (PQ::Connection* conn : m_connections)
-        conn->finish();
-
-    m_connections.clear();
-}
-
-
-void PGSQLConnectionPool::CloseFreeConnections()
-{
-    Lock lock(m_lock);
-
-    while (!m_availableConnections.empty())
-    {
-        PQ::Connection* pconn = m_availableConnections.front();
-        pconn->finish();
-
-        m_availableConnections.pop();
-    }
-}
-
-
-PGSQLConnectionPoolContainer::PGSQLConnectionPoolContainer()
-    :m_pools() {
-}
-
-
-PGSQLConnectionPoolContainer::~PGSQLConnectionPoolContainer() {
-    for (auto & any : m_pools) {
-        PGSQLConnectionPool* pool = any.second;
-        pool->CloseAllConnections();
+    if (!pgsql->get()) {
+        delete pgsql;
+        FAIL_RETURN;
     }
+    return Resource(pgsql);
 }
 
-
-
-PGSQLConnectionPool& PGSQLConnectionPoolContainer::GetPool(const std::string connString)
-{
-    Lock lock(m_lock);
-
-    auto pool = m_pools[connString];
-
-    if (pool == nullptr)
-    {
-        pool = new PGSQLConnectionPool(connString);
-
-        m_pools[connString] = pool;
+// Checks a connection out of a cluster declared in PGSQL.Clusters
+static Variant pconnect_cluster(const char *fn_name, const String& cluster_name, bool readOnly) {
+    auto it = s_connectionClusters.find(cluster_name.toCppString());
+    if (it == s_connectionClusters.end()) {
+        raise_warning("%s(): Unknown cluster \"%s\"", fn_name, cluster_name.data());
+        FAIL_RETURN;
     }
 
-    return *pool;
-}
-
-
-
-std::vector<PGSQLConnectionPool*>& PGSQLConnectionPoolContainer::GetPools()
-{
-    Lock lock(m_lock);
-
-    std::vector<PGSQLConnectionPool*>* v = new std::vector<PGSQLConnectionPool*>();
+    PGSQLConnectionPool* pool = nullptr;
+    PGSQLCheckoutFailure failure;
 
-    for (auto it : m_pools)
-    {
-        v->push_back(it.second);
+    PQ::Connection* conn = it->second->GetConnection(readOnly, pool, failure);
+    if (conn == nullptr) {
+        raise_warning("%s(): %s", fn_name, failure.m_message.c_str());
+        FAIL_RETURN;
     }
 
-    return *v;
+    return Resource(NEWRES(PGSQL)(*pool, *conn));
 }
 
-
-//////////////////////////////////////////////////////////////////////////////////
-
-
-// Simple RAII helper to convert an array to a
-// list of C strings to pass to pgsql functions. Needs
-// to be like this because string conversion may-or-may
-// not allocate and therefore needs to ensure that the
-// underlying data lasts long enough.
-struct CStringArray {
-    std::vector<String> m_strings;
-    std::vector<const char *> m_c_strs;
-
-public:
-    CStringArray(const Array& arr) {
-        int size = arr.size();
-
-        m_strings.reserve(size);
-        m_c_strs.reserve(size);
-
-        for (ArrayIter iter(arr); iter; ++iter) {
-            const Variant &param = iter.secondRef();
-            if (param.isNull()) {
-                m_strings.push_back(null_string);
-                m_c_strs.push_back(nullptr);
-            } else {
-                m_strings.push_back(param.toString());
-                m_c_strs.push_back(m_strings.back().data());
-            }
-        }
-    }
-
-    const char * const *data() {
-        return m_c_strs.data();
-    }
-
-};
-
-//////////////////// Connection functions /////////////////////////
-
-static Variant HHVM_FUNCTION(pg_connect, const String& connection_string, int connect_type /* = 0 */) {
-    PGSQL * pgsql = nullptr;
-
-    pgsql = NEWRES(PGSQL)(connection_string);
-
-    if (!pgsql->get()) {
-        delete pgsql;
-        FAIL_RETURN;
-    }
-    return Resource(pgsql);
+static Variant HHVM_FUNCTION(pg_pconnect_primary, const String& cluster_name) {
+    return pconnect_cluster("pg_pconnect_primary", cluster_name, false);
 }
 
-
-static Variant HHVM_FUNCTION(pg_pconnect, const String& connection_string, int connect_type /* = 0 */) {
-    PGSQL * pgsql = nullptr;
-
-    PGSQLConnectionPool& pool = s_connectionPoolContainer.GetPool(connection_string.toCppString());
-
-    pgsql = NEWRES(PGSQL)(pool);
-
-    if (!pgsql->get()) {
-        delete pgsql;
-        FAIL_RETURN;
-    }
-    return Resource(pgsql);
+static Variant HHVM_FUNCTION(pg_pconnect_replica, const String& cluster_name) {
+    return pconnect_cluster("pg_pconnect_replica", cluster_name, true);
 }
 
 static bool HHVM_FUNCTION(pg_close, const Resource& connection) {
@@ -747,19 +972,48 @@ const StaticString
     s_released_connections("released_connections"),
     s_errors("errors"),
     s_total_connections("total_connections"),
-    s_free_connections("free_connections");
-
-static Variant HHVM_FUNCTION(pg_connection_pool_stat) {
+    s_free_connections("free_connections"),
+    s_waiting_connections("waiting_connections"),
+    s_waited_connections("waited_connections"),
+    s_wait_timeouts("wait_timeouts"),
+    s_wait_time("wait_time"),
+    s_cleaning_connections("cleaning_connections"),
+    s_cleaned_connections("cleaned_connections"),
+    s_checkout_time("checkout_time"),
+    s_connect_time("connect_time"),
+    s_use_time("use_time"),
+    s_connection_age("connection_age"),
+    s_count("count"),
+    s_min("min"),
+    s_max("max"),
+    s_mean("mean"),
+    s_p50("p50"),
+    s_p90("p90"),
+    s_p99("p99"),
+    s_p999("p99.9");
+
+static Array histogram_stat(const PGSQLStats::Histogram& histogram) {
+    Array ret;
 
+    ret.set(s_count, histogram.count());
+    ret.set(s_min, histogram.min());
+    ret.set(s_max, histogram.max());
+    ret.set(s_mean, histogram.mean());
+    ret.set(s_p50, histogram.percentile(50));
+    ret.set(s_p90, histogram.percentile(90));
+    ret.set(s_p99, histogram.percentile(99));
+    ret.set(s_p999, histogram.percentile(99.9));
 
+    return ret;
+}
 
-    auto pools = s_connectionPoolContainer.GetPools();
+static Variant HHVM_FUNCTION(pg_connection_pool_stat) {
 
     Array arr;
 
     int i = 0;
 
-    for (auto pool : pools)
+    s_connectionPoolContainer.ForEachPool([&](PGSQLConnectionPool* pool)
     {
         Array poolArr;
 
@@ -773,10 +1027,20 @@ static Variant HHVM_FUNCTION(pg_connection_pool_stat) {
         poolArr.set(s_errors, pool->Errors());
         poolArr.set(s_total_connections, pool->TotalConnectionsCount());
         poolArr.set(s_free_connections, pool->FreeConnectionsCount());
+        poolArr.set(s_waiting_connections, pool->WaitingCount());
+        poolArr.set(s_waited_connections, pool->WaitedConnections());
+        poolArr.set(s_wait_timeouts, pool->WaitTimeouts());
+        poolArr.set(s_wait_time, pool->WaitTime());
+        poolArr.set(s_cleaning_connections, pool->CleaningCount());
+        poolArr.set(s_cleaned_connections, pool->CleanedConnections());
+        poolArr.set(s_checkout_time, histogram_stat(pool->CheckoutTimes()));
+        poolArr.set(s_connect_time, histogram_stat(pool->ConnectTimes()));
+        poolArr.set(s_use_time, histogram_stat(pool->UseTimes()));
+        poolArr.set(s_connection_age, histogram_stat(pool->ConnectionAges()));
 
         arr.set(i, poolArr);
         i++;
-    }
+    });
 
     return arr;
 }
@@ -785,12 +1049,10 @@ static Variant HHVM_FUNCTION(pg_connection_pool_stat) {
 
 static void HHVM_FUNCTION(pg_connection_pool_sweep_free) {
 
-    auto pools = s_connectionPoolContainer.GetPools();
-
-    for (auto pool : pools)
+    s_connectionPoolContainer.ForEachPool([](PGSQLConnectionPool* pool)
     {
         pool->CloseFreeConnections();
-    }
+    });
 
 }
 
@@ -800,6 +1062,7 @@ static void HHVM_FUNCTION(pg_connection_pool_sweep_free) {
 static int64_t HHVM_FUNCTION(pg_connection_status, const Resource& connection) {
     PGSQL * pgsql = PGSQL::Get(connection);
     if (pgsql == nullptr) return CONNECTION_BAD;
+    if (pgsql->IsConnecting()) return (int64_t)pgsql->PollConnect();
     return (int64_t)pgsql->get().status();
 }
 
@@ -809,6 +1072,10 @@ static bool HHVM_FUNCTION(pg_connection_busy, const Resource& connection) {
         return false;
     }
 
+    if (pgsql->IsConnecting() && pgsql->PollConnect() != CONNECTION_BAD) {
+        return pgsql->IsConnecting();
+    }
+
     auto blocking = pgsql->asNonBlocking();
 
     pgsql->get().consumeInput();
@@ -884,6 +1151,78 @@ static Variant HHVM_FUNCTION(pg_client_encoding, const Resource& connection) {
     return ret;
 }
 
+// Asks for results of pg_query_params and pg_execute in binary format,
+// decoded straight into PHP values, where the column types allow it
+static bool HHVM_FUNCTION(pg_set_result_format, const Resource& connection, int64_t format) {
+    PGSQL * pgsql = PGSQL::Get(connection);
+
+    if (pgsql == nullptr) {
+        return false;
+    }
+
+    if (format != PGSQL_FORMAT_TEXT && format != PGSQL_FORMAT_BINARY) {
+        raise_warning("pg_set_result_format(): Unknown result format %d", (int)format);
+        return false;
+    }
+
+    pgsql->m_resultFormat = (int)format;
+
+    return true;
+}
+
+// Sends parameters of pg_query_params and pg_execute in binary where the
+// server expects bytea, or an int, float or bool type that the PHP value
+// matches. bytea parameters are then raw bytes, not escaped strings.
+static bool HHVM_FUNCTION(pg_set_param_format, const Resource& connection, int64_t format) {
+    PGSQL * pgsql = PGSQL::Get(connection);
+
+    if (pgsql == nullptr) {
+        return false;
+    }
+
+    if (format != PGSQL_FORMAT_TEXT && format != PGSQL_FORMAT_BINARY) {
+        raise_warning("pg_set_param_format(): Unknown parameter format %d", (int)format);
+        return false;
+    }
+
+    pgsql->m_paramFormat = (int)format;
+
+    return true;
+}
+
+// Has results of later queries on the connection return int2, int4, int8
+// and oid columns as ints, float4 and float8 as floats, and bool as bools.
+// numeric columns stay strings unless PGSQL_NUMERIC_FLOAT is given.
+static bool HHVM_FUNCTION(pg_set_typed_fetch, const Resource& connection, bool enable, int64_t numeric_mode /* = PGSQL_NUMERIC_STRING */) {
+    PGSQL * pgsql = PGSQL::Get(connection);
+
+    if (pgsql == nullptr) {
+        return false;
+    }
+
+    if (numeric_mode != PGSQL_NUMERIC_STRING && numeric_mode != PGSQL_NUMERIC_FLOAT) {
+        raise_warning("pg_set_typed_fetch(): Unknown numeric mode %d", (int)numeric_mode);
+        return false;
+    }
+
+    pgsql->m_typedFetch = enable;
+    pgsql->m_numericMode = (PGSQLNumericMode)numeric_mode;
+
+    return true;
+}
+
+// Sets how long pg_query, pg_query_params and pg_execute on the connection
+// may take, overriding PGSQL.QueryTimeoutMs
+static bool HHVM_FUNCTION(pg_set_query_timeout, const Resource& connection, int64_t timeout_ms) {
+    PGSQL * pgsql = PGSQL::Get(connection);
+    if (pgsql == nullptr) {
+        return false;
+    }
+
+    pgsql->m_queryTimeout = timeout_ms > 0 ? (int)timeout_ms : 0;
+    return true;
+}
+
 static int64_t HHVM_FUNCTION(pg_transaction_status, const Resource& connection) {
     PGSQL * pgsql = PGSQL::Get(connection);
 
@@ -1034,145 +1373,1219 @@ static String HHVM_FUNCTION(pg_escape_string, const Resource& connection, const
         return null_string;
     }
 
-    ret.shrink(size); // Shrink to the returned size, `shrink` may re-alloc and free up space
-
-    return ret;
-}
+    ret.shrink(size); // Shrink to the returned size, `shrink` may re-alloc and free up space
+
+    return ret;
+}
+
+static String HHVM_FUNCTION(pg_unescape_bytea, const String& data) {
+    size_t to_len = 0;
+    char * unesc = (char *)PQunescapeBytea((unsigned char *)data.data(), &to_len);
+    String ret = String(unesc, to_len, CopyString);
+    PQfreemem(unesc);
+    return ret;
+}
+
+///////////// Command Execution / Querying /////////////////////////////
+
+static int64_t HHVM_FUNCTION(pg_affected_rows, const Resource& result) {
+    PGSQLResult *res = PGSQLResult::Get(result);
+    if (res == nullptr) return 0;
+
+    return (int64_t)res->get().cmdTuples();
+}
+
+static Variant HHVM_FUNCTION(pg_result_status, const Resource& result, int64_t type /* = PGSQL_STATUS_LONG */) {
+    PGSQLResult *res = PGSQLResult::Get(result);
+
+    if (type == PGSQL_STATUS_LONG) {
+        if (res == nullptr) return 0;
+
+        return (int64_t)res->get().status();
+    } else {
+        if (res == nullptr) return null_string;
+
+        String ret(res->get().cmdStatus(), CopyString);
+        return ret;
+    }
+}
+
+static bool HHVM_FUNCTION(pg_free_result, const Resource& result) {
+    PGSQLResult *res = PGSQLResult::Get(result);
+    if (res) {
+        res->close();
+        return true;
+    } else {
+        return false;
+    }
+}
+
+static bool _handle_query_result(const char *fn_name, PQ::Connection &conn, PQ::Result &result) {
+    if (!result) {
+        const char * err = conn.errorMessage();
+        raise_warning("%s(): Query failed: %s", fn_name, err);
+        return true;
+    } else {
+        int st = result.status();
+        switch (st) {
+            default:
+                break;
+            case PGRES_EMPTY_QUERY:
+            case PGRES_BAD_RESPONSE:
+            case PGRES_NONFATAL_ERROR:
+            case PGRES_FATAL_ERROR:
+                const char * msg = result.errorMessage();
+                raise_warning("%s(): Query failed: %s", fn_name, msg);
+                return true;
+        }
+        return false;
+    }
+
+}
+
+// A query its deadline cancelled fails with a warning of its own, rather
+// than the server's message
+static bool _handle_query_timeout(const char *fn_name, PQ::Result &result, PGSQLQueryDeadline &deadline) {
+    if (!deadline.Cancelled(result)) {
+        return false;
+    }
+
+    raise_warning("%s(): Query timed out", fn_name);
+    return true;
+}
+
+static Variant HHVM_FUNCTION(pg_query, const Resource& connection, const String& query, int64_t timeout_ms /* = -1 */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    PGSQLQueryDeadline deadline(conn->get(), conn->m_requestDeadline, conn->QueryTimeout(timeout_ms));
+
+    PQ::Result res = conn->get().exec(query.data());
+
+    if (_handle_query_timeout("pg_query", res, deadline))
+        FAIL_RETURN;
+
+    if (_handle_query_result("pg_query", conn->get(), res))
+        FAIL_RETURN;
+
+    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
+
+    return Resource(pgresult);
+}
+
+// Streams the rows of the result instead of buffering all of them first.
+// Only the current batch of rows is held in memory, so rows can't be
+// revisited, and the connection can't be used for anything else until the
+// result has been read or freed.
+static Variant HHVM_FUNCTION(pg_query_unbuffered, const Resource& connection, const String& query, int64_t chunk_size /* = 0 */, int64_t timeout_ms /* = -1 */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    // Covers the wait for the first rows; reading the rest is up to the
+    // caller
+    PGSQLQueryDeadline deadline(conn->get(), conn->m_requestDeadline, conn->QueryTimeout(timeout_ms));
+
+    if (!conn->get().sendQuery(query.data())) {
+        raise_warning("pg_query_unbuffered(): Query failed: %s", conn->get().errorMessage());
+        FAIL_RETURN;
+    }
+
+    conn->get().setStreaming((int)chunk_size);
+
+    PQ::Result res = conn->get().result();
+
+    if (_handle_query_timeout("pg_query_unbuffered", res, deadline) ||
+        _handle_query_result("pg_query_unbuffered", conn->get(), res)) {
+        while (PQ::Result extra = conn->get().result()) {}
+        FAIL_RETURN;
+    }
+
+    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
+    pgresult->startStream();
+
+    return Resource(pgresult);
+}
+
+static Variant HHVM_FUNCTION(pg_query_params, const Resource& connection, const String& query, const Array& params, int64_t timeout_ms /* = -1 */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    auto info = conn->DescribeQuery(query, params);
+
+    CStringArray str_array(params, conn->ParamTypes(info));
+
+    PGSQLQueryDeadline deadline(conn->get(), conn->m_requestDeadline, conn->QueryTimeout(timeout_ms));
+
+    PQ::Result res = conn->get().exec(query.data(), params.size(), str_array.types(),
+                                      str_array.data(), str_array.lengths(), str_array.formats(),
+                                      conn->ResultFormat(info));
+
+    if (_handle_query_timeout("pg_query_params", res, deadline))
+        FAIL_RETURN;
+
+    if (_handle_query_result("pg_query_params", conn->get(), res))
+        FAIL_RETURN;
+
+    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
+
+    return Resource(pgresult);
+}
+
+static Variant HHVM_FUNCTION(pg_prepare, const Resource& connection, const String& stmtname, const String& query) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    conn->ForgetStatement(stmtname);
+
+    PQ::Result res = conn->get().prepare(stmtname.data(), query.data(), 0);
+
+    if (_handle_query_result("pg_prepare", conn->get(), res))
+        FAIL_RETURN;
+
+    PGSQLResult *pgres = NEWRES(PGSQLResult)(conn, std::move(res));
+
+    return Resource(pgres);
+}
+
+static Variant HHVM_FUNCTION(pg_execute, const Resource& connection, const String& stmtname, const Array& params, int64_t timeout_ms /* = -1 */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    auto info = conn->DescribeStatement(stmtname);
+
+    CStringArray str_array(params, conn->ParamTypes(info));
+
+    PGSQLQueryDeadline deadline(conn->get(), conn->m_requestDeadline, conn->QueryTimeout(timeout_ms));
+
+    PQ::Result res = conn->get().execPrepared(stmtname.data(), params.size(), str_array.data(),
+                                              str_array.lengths(), str_array.formats(),
+                                              conn->ResultFormat(info));
+    if (_handle_query_timeout("pg_execute", res, deadline)) {
+        FAIL_RETURN;
+    }
+
+    if (_handle_query_result("pg_execute", conn->get(), res)) {
+        FAIL_RETURN;
+    }
+
+    PGSQLResult *pgres = NEWRES(PGSQLResult)(conn, std::move(res));
+
+    return Resource(pgres);
+}
+
+static bool HHVM_FUNCTION(pg_send_query, const Resource& connection, const String& query) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
+
+    auto nb = conn->asNonBlocking();
+
+    bool empty = true;
+    PQ::Result res = conn->get().result();
+    while (res) {
+        res.clear();
+        empty = false;
+        res = conn->get().result();
+    }
+    if (!empty) {
+        raise_notice("There are results on this connection."
+                     " Call pg_get_result() until it returns FALSE");
+    }
+
+    if (!conn->get().sendQuery(query.data())) {
+        // TODO: Do persistent auto-reconnect
+        return false;
+    }
+
+    if (!conn->get().flushWait(-1)) {
+        raise_notice("Could not empty PostgreSQL send buffer");
+    }
+
+    return true;
+}
+
+static Variant HHVM_FUNCTION(pg_get_result, const Resource& connection) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    PQ::Result res = conn->get().result();
+
+    if (!res) {
+        FAIL_RETURN;
+    }
+
+    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
+
+    return Resource(pgresult);
+}
+
+static bool HHVM_FUNCTION(pg_send_query_params, const Resource& connection, const String& query, const Array& params) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
+
+    auto nb = conn->asNonBlocking();
+
+    bool empty = true;
+    PQ::Result res = conn->get().result();
+    while (res) {
+        res.clear();
+        empty = false;
+        res = conn->get().result();
+    }
+    if (!empty) {
+        raise_notice("There are results on this connection."
+                     " Call pg_get_result() until it returns FALSE");
+    }
+
+    CStringArray str_array(params);
+
+    if (!conn->get().sendQuery(query.data(), params.size(), str_array.data())) {
+        return false;
+    }
+
+    if (!conn->get().flushWait(-1)) {
+        raise_notice("Could not empty PostgreSQL send buffer");
+    }
+
+    return true;
+}
+
+// Waits until pg_get_result() can return without blocking, for up to
+// timeout_ms milliseconds, or for ever if it is negative.
+static bool HHVM_FUNCTION(pg_wait_result, const Resource& connection, int64_t timeout_ms /* = -1 */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
+
+    return conn->get().waitResultFor((int)timeout_ms);
+}
+
+static bool HHVM_FUNCTION(pg_send_prepare, const Resource& connection, const String& stmtname, const String& query) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
+
+    return conn->get().sendPrepare(stmtname.data(), query.data(), 0);
+}
+
+static bool HHVM_FUNCTION(pg_send_execute, const Resource& connection, const String& stmtname, const Array& params) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
+
+    CStringArray str_array(params);
+
+    return conn->get().sendQueryPrepared(stmtname.data(),
+            params.size(), str_array.data());
+}
+
+//////////////////// LISTEN / NOTIFY /////////////////////////
+
+const StaticString
+    s_message("message"),
+    s_pid("pid"),
+    s_payload("payload");
+
+static Array notify_array(const PQ::Notification& notify, int64_t result_type) {
+    Array ret = Array::Create();
+
+    if (result_type & PGSQL_NUM) {
+        ret.set(0, String(notify.channel));
+        ret.set(1, (int64_t)notify.pid);
+        ret.set(2, String(notify.payload));
+    }
+    if (result_type & PGSQL_ASSOC) {
+        ret.set(s_message, String(notify.channel));
+        ret.set(s_pid, (int64_t)notify.pid);
+        ret.set(s_payload, String(notify.payload));
+    }
+
+    return ret;
+}
+
+static Variant HHVM_FUNCTION(pg_get_notify, const Resource& connection, int64_t result_type /* = PGSQL_BOTH */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    if (!(result_type & PGSQL_BOTH)) {
+        raise_warning("pg_get_notify(): Invalid result type");
+        FAIL_RETURN;
+    }
+
+    conn->get().consumeInput();
+
+    PQ::Notification notify;
+    if (!conn->get().notification(notify)) {
+        FAIL_RETURN;
+    }
+
+    return notify_array(notify, result_type);
+}
+
+// Sleeps on the socket until a notification arrives, for up to timeout_ms
+// milliseconds or for ever if it is negative, then returns every one that
+// is pending, oldest first. Returns an empty array on timeout.
+static Variant HHVM_FUNCTION(pg_wait_notify, const Resource& connection, int64_t timeout_ms /* = -1 */, int64_t result_type /* = PGSQL_BOTH */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        FAIL_RETURN;
+    }
+
+    if (!(result_type & PGSQL_BOTH)) {
+        raise_warning("pg_wait_notify(): Invalid result type");
+        FAIL_RETURN;
+    }
+
+    PQ::Connection& pq = conn->get();
+    Array ret = Array::Create();
+
+    PQ::Notification notify;
+    if (!pq.waitNotification(notify, (int)timeout_ms)) {
+        if (pq.status() != CONNECTION_OK) {
+            raise_warning("pg_wait_notify(): %s", pq.errorMessage());
+            FAIL_RETURN;
+        }
+        return ret;
+    }
+
+    do {
+        ret.append(notify_array(notify, result_type));
+    } while (pq.notification(notify));
+
+    return ret;
+}
+
+//////////////////// Async / await /////////////////////////
+
+// The Awaitable of pg_query_async() and pg_execute_async(). The query is
+// sent on the request thread; the poller thread then reads the result as
+// it arrives, and the request builds the result resource once it resumes.
+// Until then the connection belongs to the poller, and anything else done
+// with it waits for the query to finish.
+class PGSQLQueryEvent final : public AsioExternalThreadEvent, public PGSQLAsyncOperation {
+public:
+    PGSQLQueryEvent(PGSQL *conn, const char *fn_name)
+        : m_conn(conn), m_fnName(fn_name) {
+        if (m_conn) {
+            m_pq = &m_conn->get();
+            m_conn->incRefCount();
+        }
+    }
+
+    // Sends the query with send(), then hands the rest to the poller
+    template<class F>
+    void Start(F send) {
+        if (!m_conn) {
+            markAsFinished();
+            return;
+        }
+
+        m_nonBlocking = m_pq->isNonBlocking();
+        m_pq->setNonBlocking(true);
+
+        // raise_notice() can only be called on the request thread
+        m_pq->setNoticeProcessor(buffer_notice, this);
+
+        if (!send(*m_pq)) {
+            m_error = m_pq->errorMessage();
+            Finish();
+            return;
+        }
+
+        // A request awaiting the query can't time out until it completes
+        m_deadline.reset(new PGSQLQueryDeadline(*m_pq, m_conn->m_requestDeadline, 0));
+
+        m_conn->m_async = m_state = std::make_shared<PGSQLAsyncState>();
+        s_asyncPoller.Add(this);
+    }
+
+    PQ::Connection& connection() override { return *m_pq; }
+
+    bool WantsWrite() const override { return m_sending; }
+
+    bool Step() override {
+        if (m_sending) {
+            int ret = m_pq->flush();
+            if (ret < 0) return Fail();
+            if (ret > 0) return !m_pq->consumeInput() && Fail();
+            m_sending = false;
+        }
+
+        if (!m_pq->consumeInput()) return Fail();
+
+        while (!m_pq->isBusy()) {
+            PQ::Result res = m_pq->result();
+            if (!res) return true;
+
+            // Like PQexec(), keep the last result of a multi-statement query
+            m_res = std::move(res);
+
+            switch (m_res.status()) {
+                case PGRES_COPY_IN:
+                case PGRES_COPY_OUT:
+                case PGRES_COPY_BOTH:
+                    return true;
+                default:
+                    break;
+            }
+        }
+
+        return false;
+    }
+
+    void Finish() override {
+        // The connection may be closed by the time the request resumes
+        if (!m_res && m_error.empty()) {
+            m_error = m_pq->errorMessage();
+        }
+
+        m_deadline.reset();
+        m_conn->SetupNoticeProcessor();
+        m_pq->setNonBlocking(m_nonBlocking);
+
+        // The request may carry on with the connection from here
+        if (m_state) m_state->Done();
+
+        markAsFinished();
+    }
+
+protected:
+    void unserialize(Cell& result) override {
+        Variant ret(FAIL_VALUE);
+
+        if (m_conn) {
+            for (auto& notice : m_notices) {
+                notice_processor(PGSQL::IgnoreNotice ? nullptr : m_conn, notice.c_str());
+            }
+
+            if (!m_conn->isResource() || !*m_pq) {
+                // pg_close() or freeing the connection released it while
+                // the query ran
+                raise_warning("%s(): Connection was closed during the query", m_fnName);
+            } else if (!m_res) {
+                raise_warning("%s(): Query failed: %s", m_fnName, m_error.c_str());
+            } else if (!_handle_query_result(m_fnName, *m_pq, m_res)) {
+                ret = Resource(NEWRES(PGSQLResult)(m_conn, std::move(m_res)));
+            }
+
+            m_conn->decRefCount();
+            m_conn = nullptr;
+        }
+
+        cellDup(*ret.asCell(), result);
+    }
+
+private:
+    static void buffer_notice(PGSQLQueryEvent *event, const char *message) {
+        event->m_notices.push_back(message);
+    }
+
+    bool Fail() {
+        m_error = m_pq->errorMessage();
+        return true;
+    }
+
+    PGSQL *m_conn;
+    PQ::Connection *m_pq = nullptr;
+    const char *m_fnName;
+    std::shared_ptr<PGSQLAsyncState> m_state;
+    std::unique_ptr<PGSQLQueryDeadline> m_deadline;
+
+    bool m_nonBlocking = false;
+    bool m_sending = true;
+
+    PQ::Result m_res;
+    std::string m_error;
+    std::vector<std::string> m_notices;
+};
+
+// Looks the connection up and makes sure it can take an async query. A
+// null connection makes the Awaitable fail.
+static PGSQL *async_conn(const char *fn_name, const Resource& connection) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return nullptr;
+    }
+
+    if (conn->get().status() != CONNECTION_OK) {
+        raise_warning("%s(): Connection is not open", fn_name);
+        return nullptr;
+    }
+
+    if (conn->get().inPipeline()) {
+        raise_warning("%s(): Connection is in pipeline mode", fn_name);
+        return nullptr;
+    }
+
+    if (conn->get().transactionStatus() == PQTRANS_ACTIVE) {
+        raise_warning("%s(): There are results on this connection."
+                      " Call pg_get_result() until it returns FALSE", fn_name);
+        return nullptr;
+    }
+
+    return conn;
+}
+
+static Object HHVM_FUNCTION(pg_query_async, const Resource& connection, const String& query) {
+    auto event = new PGSQLQueryEvent(async_conn("pg_query_async", connection), "pg_query_async");
+
+    event->Start([&](PQ::Connection& pq) {
+        return pq.sendQuery(query.data());
+    });
+
+    return Object{event->getWaitHandle()};
+}
+
+static Object HHVM_FUNCTION(pg_execute_async, const Resource& connection, const String& stmtname, const Array& params) {
+    PGSQL *conn = async_conn("pg_execute_async", connection);
+    auto info = conn ? conn->DescribeStatement(stmtname) : nullptr;
+
+    auto event = new PGSQLQueryEvent(conn, "pg_execute_async");
+
+    event->Start([&](PQ::Connection& pq) {
+        CStringArray str_array(params, conn->ParamTypes(info));
+
+        return pq.sendQueryPrepared(stmtname.data(), params.size(), str_array.data(),
+                                    str_array.lengths(), str_array.formats(),
+                                    conn->ResultFormat(info));
+    });
+
+    return Object{event->getWaitHandle()};
+}
+
+// The Awaitable of pg_pconnect_async(). An idle connection is handed over
+// straight away; otherwise the checkout, which may queue for a connection
+// or open one, is left to s_asyncWorkers.
+class PGSQLCheckoutEvent final : public AsioExternalThreadEvent {
+public:
+    explicit PGSQLCheckoutEvent(PGSQLConnectionPool& pool) : m_pool(pool) {}
+
+    void Start() {
+        m_connection = m_pool.TryGetIdleConnection();
+        if (m_connection) {
+            markAsFinished();
+            return;
+        }
+
+        s_asyncWorkers.Add([this](bool stopping) {
+            if (stopping)
+                m_failure.m_message = "The connection pool is shutting down.";
+            else
+                m_connection = m_pool.TryGetConnection(m_failure);
+
+            markAsFinished();
+        });
+    }
+
+protected:
+    ~PGSQLCheckoutEvent() {
+        // Nobody awaited the checkout
+        if (m_connection) m_pool.Release(*m_connection);
+    }
+
+    void unserialize(Cell& result) override {
+        Variant ret(FAIL_VALUE);
+
+        if (m_connection) {
+            ret = Resource(NEWRES(PGSQL)(m_pool, *m_connection));
+            m_connection = nullptr;
+        } else {
+            raise_warning("pg_pconnect_async(): %s", m_failure.m_message.c_str());
+        }
+
+        cellDup(*ret.asCell(), result);
+    }
+
+private:
+    PGSQLConnectionPool& m_pool;
+    PQ::Connection *m_connection = nullptr;
+    PGSQLCheckoutFailure m_failure;
+};
+
+static Object HHVM_FUNCTION(pg_pconnect_async, const String& connection_string) {
+    PGSQLConnectionPool& pool = s_connectionPoolContainer.GetPool(connection_string.data(),
+                                                                  connection_string.size());
+
+    auto event = new PGSQLCheckoutEvent(pool);
+    event->Start();
+
+    return Object{event->getWaitHandle()};
+}
+
+//////////////////// COPY FROM STDIN /////////////////////////
+
+// Feeds COPY data to the server through a buffer that is reused for every
+// chunk. The connection is non-blocking while it runs, so a full send
+// buffer is waited out on the socket, reading whatever the server sends
+// meanwhile, rather than blocking inside libpq.
+class CopyInWriter {
+public:
+    static const size_t ChunkSize = 64 * 1024;
+
+    explicit CopyInWriter(PQ::Connection& conn)
+        : m_conn(conn), m_nb(conn, conn.isNonBlocking()) {
+        m_conn.setNonBlocking(true);
+        m_buffer.reserve(ChunkSize + ChunkSize / 4);
+    }
+
+    std::string& buffer() { return m_buffer; }
+
+    // Hands the buffer to libpq once it's worth a write
+    bool maybeFlush() {
+        return m_buffer.size() < ChunkSize || flush();
+    }
+
+    bool flush() {
+        bool ok = put(m_buffer.data(), m_buffer.size());
+        m_buffer.clear();
+        return ok;
+    }
+
+    bool put(const char *data, size_t length) {
+        if (length == 0) return true;
+
+        int ret;
+        while ((ret = m_conn.putCopyData(data, (int)length)) == 0) {
+            if (!waitWritable()) return false;
+        }
+        return ret == 1;
+    }
+
+    // Ends the COPY, aborting it with the error if one is given, and
+    // returns the result of the COPY command
+    PQ::Result finish(const char *error = nullptr) {
+        if (!error && !flush()) {
+            error = "Could not send COPY data";
+        }
+
+        int ret;
+        while ((ret = m_conn.putCopyEnd(error)) == 0) {
+            if (!waitWritable()) break;
+        }
+
+        PQ::Result res;
+        if (ret == 1 && m_conn.flushWait(-1) && m_conn.waitResult(-1)) {
+            res = m_conn.result();
+        }
+
+        while (m_conn.waitResult(-1)) {
+            PQ::Result extra = m_conn.result();
+            if (!extra) break;
+        }
+
+        return res;
+    }
+
+private:
+    bool waitWritable() {
+        return m_conn.waitSocket(true, true, -1) && m_conn.consumeInput();
+    }
+
+    PQ::Connection& m_conn;
+    ScopeNonBlocking m_nb;
+    std::string m_buffer;
+};
+
+// Appends a field in COPY's text format, backslash-escaping the delimiter,
+// line breaks and backslash itself
+static void copy_text_field(std::string& out, const Variant& value, char delimiter) {
+    if (value.isBoolean()) {
+        out += value.toBoolean() ? 't' : 'f';
+        return;
+    }
+
+    String str = value.toString();
+    const char *data = str.data();
+
+    for (int i = 0; i < str.size(); i++) {
+        char c = data[i];
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            default:
+                if (c == delimiter) out += '\\';
+                out += c;
+        }
+    }
+}
+
+static void copy_append_be(std::string& out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out += (char)((value >> (i * 8)) & 0xff);
+    }
+}
+
+// Column types of the COPY target, for COPY BINARY. The table name may be
+// followed by a column list, as in COPY itself. Without one, COPY fills
+// every column but generated ones, which SELECT * would include.
+static bool copy_column_types(PQ::Connection& conn, const String& table_name,
+        std::vector<Oid>& types) {
+    std::string target = table_name.toCppString();
+
+    size_t open = target.find('(');
+    size_t close = target.rfind(')');
+    if (open != std::string::npos && close != std::string::npos && close > open) {
+        std::string columns = target.substr(open + 1, close - open - 1);
+        target = target.substr(0, open);
+
+        PQ::Result res = conn.exec("SELECT " + columns + " FROM " + target + " LIMIT 0");
+        if (res.status() != PGRES_TUPLES_OK) {
+            return false;
+        }
+
+        for (int i = 0; i < res.numFields(); i++) {
+            types.push_back(res.type(i));
+        }
+
+        return true;
+    }
+
+    size_t end = target.find_last_not_of(" \t\n");
+    target.erase(end == std::string::npos ? 0 : end + 1);
+
+    // Domains are sent in the format of their base type
+    std::string query =
+        "SELECT COALESCE(NULLIF(t.typbasetype, 0), a.atttypid) "
+        "FROM pg_attribute a JOIN pg_type t ON t.oid = a.atttypid "
+        "WHERE a.attrelid = $1::regclass AND a.attnum > 0 AND NOT a.attisdropped";
+    if (conn.serverVersion() >= 120000) {
+        query += " AND a.attgenerated = ''";
+    }
+    query += " ORDER BY a.attnum";
+
+    const char *values[1] = { target.c_str() };
+    PQ::Result res = conn.exec(query.c_str(), 1, values);
+    if (res.status() != PGRES_TUPLES_OK || res.numTuples() == 0) {
+        return false;
+    }
+
+    for (int i = 0; i < res.numTuples(); i++) {
+        types.push_back((Oid)strtoul(res.getValue(i, 0), nullptr, 10));
+    }
+
+    return true;
+}
+
+// Adds one row given as an array of fields, or as a preformatted line
+static const char *copy_add_row(std::string& out, const Variant& row, bool binary,
+        const std::vector<Oid>& types, char delimiter, const String& null_as) {
+    if (!row.isArray()) {
+        if (binary) return "Rows must be arrays for COPY BINARY";
+
+        String line = row.toString();
+        out.append(line.data(), line.size());
+        if (line.empty() || line.data()[line.size() - 1] != '\n') out += '\n';
+        return nullptr;
+    }
+
+    Array fields = row.toArray();
+
+    if (binary) {
+        if (fields.size() != (ssize_t)types.size()) return "Row has the wrong number of fields";
+
+        copy_append_be(out, (uint64_t)fields.size(), 2);
+
+        int i = 0;
+        for (ArrayIter iter(fields); iter; ++iter, ++i) {
+            const Variant& value = iter.secondRef();
+            if (value.isNull()) {
+                copy_append_be(out, (uint64_t)-1, 4);
+                continue;
+            }
+
+            // Length goes in front, once the value is known
+            size_t start = out.size();
+            copy_append_be(out, 0, 4);
+            if (!pgsql_append_binary(out, types[i], value)) {
+                return "Value doesn't match its column's type";
+            }
+
+            std::string length;
+            copy_append_be(length, (uint64_t)(out.size() - start - 4), 4);
+            out.replace(start, 4, length);
+        }
+        return nullptr;
+    }
+
+    bool first = true;
+    for (ArrayIter iter(fields); iter; ++iter) {
+        if (!first) out += delimiter;
+        first = false;
+
+        const Variant& value = iter.secondRef();
+        if (value.isNull()) {
+            out.append(null_as.data(), null_as.size());
+        } else {
+            copy_text_field(out, value, delimiter);
+        }
+    }
+    out += '\n';
+
+    return nullptr;
+}
+
+// Rows may be an array or Iterator (such as a generator) of rows, each an
+// array of fields or a preformatted line, or a stream of COPY data. With
+// PGSQL_COPY_BINARY the data is sent in binary, unless a column's type
+// can't be, in which case it falls back to text.
+const StaticString
+    s_Iterator("Iterator"),
+    s_IteratorAggregate("IteratorAggregate"),
+    s_getIterator("getIterator");
+
+// ArrayIter can only walk collections and Iterators, so an
+// IteratorAggregate is asked for its Iterator. Returns a null Object for
+// anything else.
+static Object copy_rows_iterator(Object rows) {
+    // getIterator() may hand back another IteratorAggregate
+    for (int depth = 0; depth < 16 && !rows.isNull(); depth++) {
+        if (rows->isCollection() || rows.instanceof(s_Iterator)) {
+            return rows;
+        }
+
+        if (!rows.instanceof(s_IteratorAggregate)) {
+            break;
+        }
+
+        Variant inner = rows->o_invoke_few_args(s_getIterator, 0);
+        if (!inner.isObject()) {
+            break;
+        }
+        rows = inner.toObject();
+    }
+
+    return Object();
+}
+
+static bool HHVM_FUNCTION(pg_copy_from, const Resource& connection, const String& table_name, const Variant& rows, const String& delimiter /* = "\t" */, const String& null_as /* = "\\N" */, int64_t flags /* = 0 */) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
+
+    if (delimiter.size() != 1) {
+        raise_warning("pg_copy_from(): Delimiter must be a single character");
+        return false;
+    }
+
+    Object iterable;
+    if (rows.isObject()) {
+        iterable = copy_rows_iterator(rows.toObject());
+        if (iterable.isNull()) {
+            raise_warning("pg_copy_from(): Expects array or Traversable rows, or a stream");
+            return false;
+        }
+    } else if (!rows.isArray() && !rows.isResource()) {
+        raise_warning("pg_copy_from(): Expects array or Traversable rows, or a stream");
+        return false;
+    }
+
+    PQ::Connection& pq = conn->get();
+
+    std::vector<Oid> types;
+    bool binary = (flags & PGSQL_COPY_BINARY) != 0;
+
+    if (binary && !rows.isResource()) {
+        if (!copy_column_types(pq, table_name, types)) {
+            raise_warning("pg_copy_from(): Could not get the columns of %s", table_name.data());
+            return false;
+        }
+
+        for (Oid type : types) {
+            if (!pgsql_has_binary_encoder(type)) {
+                binary = false;
+                break;
+            }
+        }
+    }
+
+    std::string command = "COPY " + table_name.toCppString() + " FROM STDIN";
+    if (binary) {
+        command += " WITH (FORMAT binary)";
+    } else {
+        command += " WITH (FORMAT text, DELIMITER " +
+            pq.escapeLiteral(delimiter.data(), delimiter.size()) + ", NULL " +
+            pq.escapeLiteral(null_as.data(), null_as.size()) + ")";
+    }
+
+    PQ::Result res = pq.exec(command);
+    if (res.status() != PGRES_COPY_IN) {
+        if (!_handle_query_result("pg_copy_from", pq, res)) {
+            raise_warning("pg_copy_from(): Query failed: %s", pq.errorMessage());
+        }
+        return false;
+    }
+    res.clear();
+
+    CopyInWriter writer(pq);
+    std::string& buf = writer.buffer();
+    const char *error = nullptr;
+
+    if (rows.isResource()) {
+        // Already in COPY's format; pass it through
+        while (!error) {
+            Variant chunk = HHVM_FN(stream_get_contents)(rows.toResource(), (int)CopyInWriter::ChunkSize);
+            if (!chunk.isString()) {
+                error = "Could not read from stream";
+            } else if (chunk.toString().empty()) {
+                break;
+            } else if (!writer.put(chunk.toString().data(), chunk.toString().size())) {
+                error = "Could not send COPY data";
+            }
+        }
+    } else {
+        if (binary) {
+            // Signature, flags and header extension length
+            buf.append("PGCOPY\n\377\r\n\0", 11);
+            copy_append_be(buf, 0, 4);
+            copy_append_be(buf, 0, 4);
+        }
+
+        auto add = [&](const Variant& row) {
+            error = copy_add_row(buf, row, binary, types, delimiter.data()[0], null_as);
+            if (!error && !writer.maybeFlush()) {
+                error = "Could not send COPY data";
+            }
+            return error == nullptr;
+        };
+
+        if (rows.isArray()) {
+            for (ArrayIter iter(rows.toArray()); iter && add(iter.secondRef()); ++iter) {}
+        } else {
+            for (ArrayIter iter(iterable); iter && add(iter.second()); ++iter) {}
+        }
+
+        if (binary && !error) {
+            copy_append_be(buf, (uint64_t)-1, 2);
+        }
+    }
+
+    res = writer.finish(error);
+
+    if (error) {
+        raise_warning("pg_copy_from(): %s", error);
+        return false;
+    }
+
+    if (!res) {
+        raise_warning("pg_copy_from(): Query failed: %s", pq.errorMessage());
+        return false;
+    }
 
-static String HHVM_FUNCTION(pg_unescape_bytea, const String& data) {
-    size_t to_len = 0;
-    char * unesc = (char *)PQunescapeBytea((unsigned char *)data.data(), &to_len);
-    String ret = String(unesc, to_len, CopyString);
-    PQfreemem(unesc);
-    return ret;
+    return !_handle_query_result("pg_copy_from", pq, res);
 }
 
-///////////// Command Execution / Querying /////////////////////////////
+//////////////////// COPY TO STDOUT /////////////////////////
 
-static int64_t HHVM_FUNCTION(pg_affected_rows, const Resource& result) {
-    PGSQLResult *res = PGSQLResult::Get(result);
-    if (res == nullptr) return 0;
+// Runs a COPY ... TO STDOUT, handing each row to `sink` as it arrives.
+// If the sink fails the COPY is cancelled, and the rest of the data read
+// and dropped so the connection is left usable.
+template<class F>
+static bool copy_out(const char *fn_name, PQ::Connection& pq, const std::string& command, F sink) {
+    PQ::Result res = pq.exec(command);
+    if (res.status() != PGRES_COPY_OUT) {
+        if (!_handle_query_result(fn_name, pq, res)) {
+            raise_warning("%s(): Query failed: %s", fn_name, pq.errorMessage());
+        }
+        return false;
+    }
+    res.clear();
 
-    return (int64_t)res->get().cmdTuples();
-}
+    bool ok = true;
 
-static Variant HHVM_FUNCTION(pg_result_status, const Resource& result, int64_t type /* = PGSQL_STATUS_LONG */) {
-    PGSQLResult *res = PGSQLResult::Get(result);
+    while (true) {
+        char *data = nullptr;
+        int length = pq.getCopyData(&data);
 
-    if (type == PGSQL_STATUS_LONG) {
-        if (res == nullptr) return 0;
+        if (length == -1) {
+            break;
+        }
 
-        return (int64_t)res->get().status();
-    } else {
-        if (res == nullptr) return null_string;
+        if (length < 0) {
+            raise_warning("%s(): %s", fn_name, pq.errorMessage());
+            ok = false;
+            break;
+        }
 
-        String ret(res->get().cmdStatus(), CopyString);
-        return ret;
-    }
-}
+        if (ok && !sink(data, length)) {
+            ok = false;
+            pq.cancel();
+        }
 
-static bool HHVM_FUNCTION(pg_free_result, const Resource& result) {
-    PGSQLResult *res = PGSQLResult::Get(result);
-    if (res) {
-        res->close();
-        return true;
-    } else {
-        return false;
+        PQ::Connection::freeMem(data);
     }
-}
 
-static bool _handle_query_result(const char *fn_name, PQ::Connection &conn, PQ::Result &result) {
-    if (!result) {
-        const char * err = conn.errorMessage();
-        raise_warning("%s(): Query failed: %s", fn_name, err);
-        return true;
-    } else {
-        int st = result.status();
-        switch (st) {
-            default:
-                break;
-            case PGRES_EMPTY_QUERY:
-            case PGRES_BAD_RESPONSE:
-            case PGRES_NONFATAL_ERROR:
-            case PGRES_FATAL_ERROR:
-                const char * msg = result.errorMessage();
-                raise_warning("%s(): Query failed: %s", fn_name, msg);
-                return true;
+    while (PQ::Result last = pq.result()) {
+        if (ok && last.status() != PGRES_COMMAND_OK) {
+            raise_warning("%s(): Query failed: %s", fn_name, last.errorMessage());
+            ok = false;
         }
-        return false;
     }
 
+    return ok;
 }
 
-static Variant HHVM_FUNCTION(pg_query, const Resource& connection, const String& query) {
+// Returns the rows of the table as an array of lines in COPY's text format
+static Variant HHVM_FUNCTION(pg_copy_to, const Resource& connection, const String& table_name, const String& delimiter /* = "\t" */, const String& null_as /* = "\\N" */) {
     PGSQL *conn = PGSQL::Get(connection);
     if (conn == nullptr) {
         FAIL_RETURN;
     }
 
-    PQ::Result res = conn->get().exec(query.data());
+    PQ::Connection& pq = conn->get();
 
-    if (_handle_query_result("pg_query", conn->get(), res))
-        FAIL_RETURN;
+    std::string command = "COPY " + table_name.toCppString() +
+        " TO STDOUT WITH (FORMAT text, DELIMITER " +
+        pq.escapeLiteral(delimiter.data(), delimiter.size()) + ", NULL " +
+        pq.escapeLiteral(null_as.data(), null_as.size()) + ")";
 
-    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
+    Array lines = Array::Create();
 
-    return Resource(pgresult);
+    bool ok = copy_out("pg_copy_to", pq, command, [&](const char *data, int length) {
+        lines.append(String(data, length, CopyString));
+        return true;
+    });
+
+    if (!ok) {
+        FAIL_RETURN;
+    }
+
+    return lines;
 }
 
-static Variant HHVM_FUNCTION(pg_query_params, const Resource& connection, const String& query, const Array& params) {
+// Writes the output of COPY ... TO STDOUT to a stream, or to the output
+// buffer if it's null, without holding more than a chunk of it in memory.
+// $source is a table name, optionally with a column list, or a query in
+// parentheses; $options go in COPY's WITH clause, e.g. "FORMAT csv, HEADER".
+// Returns the number of bytes written.
+static Variant HHVM_FUNCTION(pg_copy_to_stream, const Resource& connection, const String& source, const Variant& stream /* = null_variant */, const String& options /* = "" */) {
     PGSQL *conn = PGSQL::Get(connection);
     if (conn == nullptr) {
         FAIL_RETURN;
     }
 
-    CStringArray str_array(params);
+    File *file = nullptr;
+    if (!stream.isNull()) {
+        file = stream.isResource() ? stream.toResource().getTyped<File>(true, true) : nullptr;
+        if (file == nullptr) {
+            raise_warning("pg_copy_to_stream(): Target must be a stream or null");
+            FAIL_RETURN;
+        }
+    }
 
-    PQ::Result res = conn->get().exec(query.data(), params.size(), str_array.data());
+    std::string command = "COPY " + source.toCppString() + " TO STDOUT";
+    if (!options.empty()) {
+        command += " WITH (" + options.toCppString() + ")";
+    }
 
-    if (_handle_query_result("pg_query_params", conn->get(), res))
-        FAIL_RETURN;
+    // Rows are small; write them out in bigger pieces
+    static const size_t ChunkSize = 64 * 1024;
+    std::string buffer;
+    buffer.reserve(ChunkSize + ChunkSize / 4);
+    int64_t written = 0;
 
-    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
+    auto flush = [&]() {
+        if (buffer.empty()) {
+            return true;
+        }
 
-    return Resource(pgresult);
-}
+        int64_t count = buffer.size();
+        if (file) {
+            count = file->write(String(buffer.data(), buffer.size(), CopyString));
+        } else {
+            g_context->write(buffer.data(), buffer.size());
+        }
 
-static Variant HHVM_FUNCTION(pg_prepare, const Resource& connection, const String& stmtname, const String& query) {
-    PGSQL *conn = PGSQL::Get(connection);
-    if (conn == nullptr) {
+        // Only what actually reached the stream counts
+        bool ok = count == (int64_t)buffer.size();
+        if (count < 0) {
+            count = 0;
+        }
+        if (!ok) {
+            raise_warning("pg_copy_to_stream(): Writing to the stream failed after %lld of %zu bytes",
+                          (long long)count, buffer.size());
+        }
+
+        written += count;
+        buffer.clear();
+        return ok;
+    };
+
+    bool ok = copy_out("pg_copy_to_stream", conn->get(), command, [&](const char *data, int length) {
+        buffer.append(data, length);
+        return buffer.size() < ChunkSize || flush();
+    });
+
+    if (!flush()) {
+        ok = false;
+    }
+
+    if (!ok) {
         FAIL_RETURN;
     }
 
-    PQ::Result res = conn->get().prepare(stmtname.data(), query.data(), 0);
+    return written;
+}
 
-    if (_handle_query_result("pg_prepare", conn->get(), res))
-        FAIL_RETURN;
+// For a COPY ... FROM STDIN started with pg_query(), sends data as is
+static bool HHVM_FUNCTION(pg_put_line, const Resource& connection, const String& data) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
+        return false;
+    }
 
-    PGSQLResult *pgres = NEWRES(PGSQLResult)(conn, std::move(res));
+    if (conn->get().putCopyData(data.data(), data.size()) != 1) {
+        raise_warning("pg_put_line(): %s", conn->get().errorMessage());
+        return false;
+    }
 
-    return Resource(pgres);
+    return true;
 }
 
-static Variant HHVM_FUNCTION(pg_execute, const Resource& connection, const String& stmtname, const Array& params) {
+static bool HHVM_FUNCTION(pg_end_copy, const Resource& connection) {
     PGSQL *conn = PGSQL::Get(connection);
     if (conn == nullptr) {
-        FAIL_RETURN;
+        return false;
     }
 
-    CStringArray str_array(params);
-
-    PQ::Result res = conn->get().execPrepared(stmtname.data(), params.size(), str_array.data());
-    if (_handle_query_result("pg_execute", conn->get(), res)) {
-        FAIL_RETURN;
+    if (conn->get().putCopyEnd() != 1) {
+        raise_warning("pg_end_copy(): %s", conn->get().errorMessage());
+        return false;
     }
 
-    PGSQLResult *pgres = NEWRES(PGSQLResult)(conn, std::move(res));
+    bool ok = true;
+    while (PQ::Result res = conn->get().result()) {
+        if (res.status() != PGRES_COMMAND_OK) {
+            raise_warning("pg_end_copy(): Query failed: %s", res.errorMessage());
+            ok = false;
+        }
+    }
 
-    return Resource(pgres);
+    return ok;
 }
 
-static bool HHVM_FUNCTION(pg_send_query, const Resource& connection, const String& query) {
+static bool HHVM_FUNCTION(pg_cancel_query, const Resource& connection) {
     PGSQL *conn = PGSQL::Get(connection);
     if (conn == nullptr) {
         return false;
@@ -1180,128 +2593,156 @@ static bool HHVM_FUNCTION(pg_send_query, const Resource& connection, const Strin
 
     auto nb = conn->asNonBlocking();
 
-    bool empty = true;
+    bool ret = conn->get().cancel();
+
     PQ::Result res = conn->get().result();
-    while (res) {
+    while(res) {
         res.clear();
-        empty = false;
         res = conn->get().result();
     }
-    if (!empty) {
-        raise_notice("There are results on this connection."
-                     " Call pg_get_result() until it returns FALSE");
-    }
 
-    if (!conn->get().sendQuery(query.data())) {
-        // TODO: Do persistent auto-reconnect
+    return ret;
+}
+
+// Pipeline mode sends queries without waiting for the results of earlier
+// ones, so a batch of queries costs one round trip rather than one each.
+// Queries are queued with pg_pipeline_query() and pg_pipeline_execute(),
+// then pg_pipeline_sync() sends them and returns their results in order.
+// Once a query fails, the rest of the batch is skipped and reported as
+// PGSQL_PIPELINE_ABORTED.
+static bool HHVM_FUNCTION(pg_pipeline_begin, const Resource& connection) {
+    PGSQL *conn = PGSQL::Get(connection);
+    if (conn == nullptr) {
         return false;
     }
 
-    int ret;
-    while ((ret = conn->get().flush())) {
-        if (ret == -1) {
-            raise_notice("Could not empty PostgreSQL send buffer");
-            break;
-        }
-        usleep(5000);
+#ifndef LIBPQ_HAS_PIPELINING
+    raise_warning("pg_pipeline_begin(): libpq was built without pipeline mode");
+    return false;
+#else
+    if (!conn->get().enterPipeline()) {
+        raise_warning("pg_pipeline_begin(): %s", conn->get().errorMessage());
+        return false;
     }
 
     return true;
+#endif
 }
 
-static Variant HHVM_FUNCTION(pg_get_result, const Resource& connection) {
+static PGSQL *pipeline_conn(const char *fn_name, const Resource& connection) {
     PGSQL *conn = PGSQL::Get(connection);
     if (conn == nullptr) {
-        FAIL_RETURN;
+        return nullptr;
     }
 
-    PQ::Result res = conn->get().result();
-
-    if (!res) {
-        FAIL_RETURN;
+    if (!conn->get().inPipeline()) {
+        raise_warning("%s(): Connection is not in pipeline mode", fn_name);
+        return nullptr;
     }
 
-    PGSQLResult *pgresult = NEWRES(PGSQLResult)(conn, std::move(res));
-
-    return Resource(pgresult);
+    return conn;
 }
 
-static bool HHVM_FUNCTION(pg_send_query_params, const Resource& connection, const String& query, const Array& params) {
-    PGSQL *conn = PGSQL::Get(connection);
+// Queued queries are sent without blocking, so that a large batch can't
+// stall with both ends waiting to write
+static bool HHVM_FUNCTION(pg_pipeline_query, const Resource& connection, const String& query, const Array& params /* = null_array */) {
+    PGSQL *conn = pipeline_conn("pg_pipeline_query", connection);
     if (conn == nullptr) {
         return false;
     }
 
     auto nb = conn->asNonBlocking();
-
-    bool empty = true;
-    PQ::Result res = conn->get().result();
-    while (res) {
-        res.clear();
-        empty = false;
-        res = conn->get().result();
-    }
-    if (!empty) {
-        raise_notice("There are results on this connection."
-                     " Call pg_get_result() until it returns FALSE");
-    }
+    conn->get().setNonBlocking(true);
 
     CStringArray str_array(params);
 
     if (!conn->get().sendQuery(query.data(), params.size(), str_array.data())) {
+        raise_warning("pg_pipeline_query(): %s", conn->get().errorMessage());
         return false;
     }
 
-    int ret;
-    while ((ret = conn->get().flush())) {
-        if (ret == -1) {
-            raise_notice("Could not empty PostgreSQL send buffer");
-            break;
-        }
-        usleep(5000);
-    }
-
     return true;
 }
 
-static bool HHVM_FUNCTION(pg_send_prepare, const Resource& connection, const String& stmtname, const String& query) {
-    PGSQL *conn = PGSQL::Get(connection);
+static bool HHVM_FUNCTION(pg_pipeline_execute, const Resource& connection, const String& stmtname, const Array& params /* = null_array */) {
+    PGSQL *conn = pipeline_conn("pg_pipeline_execute", connection);
     if (conn == nullptr) {
         return false;
     }
 
-    return conn->get().sendPrepare(stmtname.data(), query.data(), 0);
+    auto nb = conn->asNonBlocking();
+    conn->get().setNonBlocking(true);
+
+    CStringArray str_array(params);
+
+    if (!conn->get().sendQueryPrepared(stmtname.data(), params.size(), str_array.data())) {
+        raise_warning("pg_pipeline_execute(): %s", conn->get().errorMessage());
+        return false;
+    }
+
+    return true;
 }
 
-static bool HHVM_FUNCTION(pg_send_execute, const Resource& connection, const String& stmtname, const Array& params) {
-    PGSQL *conn = PGSQL::Get(connection);
+static Variant HHVM_FUNCTION(pg_pipeline_sync, const Resource& connection) {
+    PGSQL *conn = pipeline_conn("pg_pipeline_sync", connection);
     if (conn == nullptr) {
-        return false;
+        FAIL_RETURN;
     }
 
-    CStringArray str_array(params);
+    auto nb = conn->asNonBlocking();
+    conn->get().setNonBlocking(true);
 
-    return conn->get().sendQueryPrepared(stmtname.data(),
-            params.size(), str_array.data());
+    if (!conn->get().pipelineSync() || !conn->get().flushWait(-1)) {
+        raise_warning("pg_pipeline_sync(): %s", conn->get().errorMessage());
+        FAIL_RETURN;
+    }
+
+    Array results = Array::Create();
+
+    while (true) {
+        if (!conn->get().waitResult(-1)) {
+            raise_warning("pg_pipeline_sync(): %s", conn->get().errorMessage());
+            FAIL_RETURN;
+        }
+
+        PQ::Result res = conn->get().result();
+
+        // Marks the end of one query's results
+        if (!res) {
+            if (conn->get().status() != CONNECTION_OK) {
+                raise_warning("pg_pipeline_sync(): %s", conn->get().errorMessage());
+                FAIL_RETURN;
+            }
+            continue;
+        }
+
+        if (res.status() == PGRES_PIPELINE_SYNC) {
+            break;
+        }
+
+        if (res.status() == PGRES_FATAL_ERROR) {
+            raise_warning("pg_pipeline_sync(): Query %d failed: %s",
+                          (int)results.size(), res.errorMessage());
+        }
+
+        results.append(Resource(NEWRES(PGSQLResult)(conn, std::move(res))));
+    }
+
+    return results;
 }
 
-static bool HHVM_FUNCTION(pg_cancel_query, const Resource& connection) {
+static bool HHVM_FUNCTION(pg_pipeline_end, const Resource& connection) {
     PGSQL *conn = PGSQL::Get(connection);
     if (conn == nullptr) {
         return false;
     }
 
-    auto nb = conn->asNonBlocking();
-
-    bool ret = conn->get().cancelRequest();
-
-    PQ::Result res = conn->get().result();
-    while(res) {
-        res.clear();
-        res = conn->get().result();
+    if (!conn->get().exitPipeline()) {
+        raise_warning("pg_pipeline_end(): %s", conn->get().errorMessage());
+        return false;
     }
 
-    return ret;
+    return true;
 }
 
 ////////////////////////
@@ -1317,12 +2758,10 @@ static Variant HHVM_FUNCTION(pg_fetch_all_columns, const Resource& result, int64
         FAIL_RETURN;
     }
 
-    int num_rows = res->getNumRows();
-
     Array arr;
-    for (int i = 0; i < num_rows; i++) {
+    for (int i = res->firstRow(); res->seekRow(i); i++) {
         Variant field = res->getFieldVal(i, column);
-        arr.set(i, field);
+        arr.append(field);
     }
 
     return arr;
@@ -1337,7 +2776,7 @@ static Variant HHVM_FUNCTION(pg_fetch_array, const Resource& result, const Varia
     int r;
     if (row.isNull()) {
         r = res->m_current_row;
-        if (r >= res->getNumRows()) {
+        if (!res->seekRow(r)) {
             FAIL_RETURN;
         }
         res->m_current_row++;
@@ -1345,7 +2784,7 @@ static Variant HHVM_FUNCTION(pg_fetch_array, const Resource& result, const Varia
         r = row.toInt32();
     }
 
-    if (r < 0 || r >= res->getNumRows()) {
+    if (r < 0 || !res->seekRow(r)) {
         raise_warning("Row `%d` out of range", r);
         FAIL_RETURN;
     }
@@ -1377,15 +2816,15 @@ static Variant HHVM_FUNCTION(pg_fetch_all, const Resource& result) {
         FAIL_RETURN;
     }
 
-    int num_rows = res->getNumRows();
-    if (num_rows == 0) {
+    int first = res->firstRow();
+    if (!res->seekRow(first)) {
         FAIL_RETURN;
     }
 
     Array rows;
-    for (int i = 0; i < num_rows; i++) {
+    for (int i = first; res->seekRow(i); i++) {
         Variant row = f_pg_fetch_assoc(result, i);
-        rows.set(i, row);
+        rows.append(row);
     }
 
     return rows;
@@ -1452,7 +2891,7 @@ static Variant HHVM_FUNCTION(pg_field_prtlen, const Resource& result, const Vari
 
     int r, f;
     if (res->convertFieldRow(row_number, field, &r, &f, "pg_field_prtlen")) {
-        return res->get().getLength(r, f);
+        return res->get().getLength(res->localRow(r), f);
     }
     FAIL_RETURN;
 }
@@ -1616,7 +3055,7 @@ static bool HHVM_FUNCTION(pg_result_seek, const Resource& result, int64_t offset
         return false;
     }
 
-    if (offset < 0 || offset > res->getNumRows()) {
+    if (offset < 0 || (!res->seekRow((int)offset) && offset != res->getNumRows())) {
         raise_warning("pg_result_seek(): Cannot seek to row %d", (int)offset);
         return false;
     }
@@ -1645,11 +3084,31 @@ bool PGSQL::AutoResetPersistent = false;
 bool PGSQL::IgnoreNotice        = false;
 bool PGSQL::LogNotice           = false;
 
+
 namespace { // Anonymous Namespace
 static class pgsqlExtension : public Extension {
 public:
     pgsqlExtension() : Extension("pgsql") {}
 
+    static PGSQLConnectionPoolOptions LoadPoolOptions(const IniSetting::Map& ini, Hdf pool)
+    {
+        auto& defaults = PGSQLConnectionPoolOptions::Defaults;
+
+        PGSQLConnectionPoolOptions options;
+        options.MaximumConnections  = Config::GetInt32(ini, pool["MaximumConnections"], -1);
+        options.MinIdle             = Config::GetInt32(ini, pool["MinIdle"], 0);
+        options.ConnectTimeout      = Config::GetInt32(ini, pool["ConnectTimeout"], 30);
+        options.MaintenanceInterval = Config::GetInt32(ini, pool["MaintenanceInterval"], 1000);
+        options.IdleTimeout         = Config::GetInt32(ini, pool["IdleTimeout"], defaults.IdleTimeout);
+        options.MaxLifetime         = Config::GetInt32(ini, pool["MaxLifetime"], defaults.MaxLifetime);
+        options.KeepaliveInterval   = Config::GetInt32(ini, pool["KeepaliveInterval"], defaults.KeepaliveInterval);
+        options.WaitTimeout         = Config::GetInt32(ini, pool["WaitTimeout"], defaults.WaitTimeout);
+        options.MaxWaiters          = Config::GetInt32(ini, pool["MaxWaiters"], defaults.MaxWaiters);
+        options.ResetSession        = Config::GetBool(ini, pool["ResetSession"], defaults.ResetSession);
+
+        return options;
+    }
+
     virtual void moduleLoad(const IniSetting::Map& ini, Hdf hdf)
     {
         Hdf pgsql = hdf["PGSQL"];
@@ -1661,16 +3120,85 @@ public:
         PGSQL::IgnoreNotice        = Config::GetBool(ini, pgsql["IgnoreNotice"]);
         PGSQL::LogNotice           = Config::GetBool(ini, pgsql["LogNotice"]);
 
+        PGSQLQueryDeadline::DefaultTimeoutMs = Config::GetInt32(ini, pgsql["QueryTimeoutMs"], 0);
+
+        PGSQLAsyncWorkers::MaxThreads = Config::GetInt32(ini, pgsql["AsyncWorkerThreads"], 4);
+
+        PGSQLConnectionPool::ShardCount = Config::GetInt32(ini, pgsql["PoolShards"], 0);
+
+        // Maintenance settings for pools created on demand by pg_pconnect,
+        // and the defaults for pools declared below
+        auto& defaults = PGSQLConnectionPoolOptions::Defaults;
+        defaults.IdleTimeout       = Config::GetInt32(ini, pgsql["PoolIdleTimeout"], 0);
+        defaults.MaxLifetime       = Config::GetInt32(ini, pgsql["PoolMaxLifetime"], 0);
+        defaults.KeepaliveInterval = Config::GetInt32(ini, pgsql["PoolKeepaliveInterval"], 0);
+        defaults.WaitTimeout       = Config::GetInt32(ini, pgsql["PoolWaitTimeout"], 0);
+        defaults.MaxWaiters        = Config::GetInt32(ini, pgsql["PoolMaxWaiters"], -1);
+        defaults.ResetSession      = Config::GetBool(ini, pgsql["PoolResetSession"], false);
+
+        // Pools declared up front are opened in the background as soon as
+        // the extension is initialised, e.g.
+        //
+        //   PGSQL.Pools.main.ConnectionString = host=db dbname=app
+        //   PGSQL.Pools.main.MinIdle = 16
+        for (Hdf pool = pgsql["Pools"].firstChild(); pool.exists(); pool = pool.next())
+        {
+            std::string connString = Config::GetString(ini, pool["ConnectionString"]);
+            if (connString.empty()) {
+                continue;
+            }
+
+            s_connectionPoolContainer.AddPool(connString, LoadPoolOptions(ini, pool));
+        }
+
+        // Clusters take the same pool settings, applied to each host, e.g.
+        //
+        //   PGSQL.Clusters.main.EjectSeconds = 30
+        //   PGSQL.Clusters.main.Hosts.db1.ConnectionString = host=db1 dbname=app
+        //   PGSQL.Clusters.main.Hosts.db1.Role = primary
+        //   PGSQL.Clusters.main.Hosts.db2.ConnectionString = host=db2 dbname=app
+        //   PGSQL.Clusters.main.Hosts.db2.Weight = 2
+        for (Hdf cluster = pgsql["Clusters"].firstChild(); cluster.exists(); cluster = cluster.next())
+        {
+            PGSQLConnectionPoolOptions options = LoadPoolOptions(ini, cluster);
+
+            std::unique_ptr<PGSQLConnectionCluster> hosts(new PGSQLConnectionCluster(
+                Config::GetInt32(ini, cluster["EjectSeconds"], 30)));
+
+            for (Hdf host = cluster["Hosts"].firstChild(); host.exists(); host = host.next())
+            {
+                std::string connString = Config::GetString(ini, host["ConnectionString"]);
+                if (connString.empty()) {
+                    continue;
+                }
+
+                std::string role = Config::GetString(ini, host["Role"], "replica");
+
+                hosts->AddHost(s_connectionPoolContainer.AddPool(connString, options),
+                               role == "primary",
+                               Config::GetInt32(ini, host["Weight"], 1));
+            }
+
+            s_connectionClusters[cluster.getName()] = std::move(hosts);
+        }
+
     }
 
     virtual void moduleInit() {
 
         HHVM_FE(pg_affected_rows);
+        HHVM_FE(pg_async_connect);
         HHVM_FE(pg_cancel_query);
         HHVM_FE(pg_client_encoding);
         HHVM_FE(pg_close);
         HHVM_FE(pg_connect);
+        HHVM_FE(pg_copy_from);
+        HHVM_FE(pg_copy_to);
+        HHVM_FE(pg_copy_to_stream);
+        HHVM_FE(pg_pconnect_async);
         HHVM_FE(pg_pconnect);
+        HHVM_FE(pg_pconnect_primary);
+        HHVM_FE(pg_pconnect_replica);
         HHVM_FE(pg_connection_pool_stat);
         HHVM_FE(pg_connection_pool_sweep_free);
         HHVM_FE(pg_connection_busy);
@@ -1681,6 +3209,8 @@ public:
         HHVM_FE(pg_escape_identifier);
         HHVM_FE(pg_escape_literal);
         HHVM_FE(pg_escape_string);
+        HHVM_FE(pg_end_copy);
+        HHVM_FE(pg_execute_async);
         HHVM_FE(pg_execute);
         HHVM_FE(pg_fetch_all_columns);
         HHVM_FE(pg_fetch_all);
@@ -1697,6 +3227,7 @@ public:
         HHVM_FE(pg_field_type_oid);
         HHVM_FE(pg_field_type);
         HHVM_FE(pg_free_result);
+        HHVM_FE(pg_get_notify);
         HHVM_FE(pg_get_pid);
         HHVM_FE(pg_get_result);
         HHVM_FE(pg_host);
@@ -1708,9 +3239,17 @@ public:
         HHVM_FE(pg_options);
         HHVM_FE(pg_parameter_status);
         HHVM_FE(pg_ping);
+        HHVM_FE(pg_pipeline_begin);
+        HHVM_FE(pg_pipeline_end);
+        HHVM_FE(pg_pipeline_execute);
+        HHVM_FE(pg_pipeline_query);
+        HHVM_FE(pg_pipeline_sync);
         HHVM_FE(pg_port);
         HHVM_FE(pg_prepare);
+        HHVM_FE(pg_put_line);
+        HHVM_FE(pg_query_async);
         HHVM_FE(pg_query_params);
+        HHVM_FE(pg_query_unbuffered);
         HHVM_FE(pg_query);
         HHVM_FE(pg_result_error_field);
         HHVM_FE(pg_result_error);
@@ -1720,9 +3259,15 @@ public:
         HHVM_FE(pg_send_prepare);
         HHVM_FE(pg_send_query_params);
         HHVM_FE(pg_send_query);
+        HHVM_FE(pg_set_param_format);
+        HHVM_FE(pg_set_result_format);
+        HHVM_FE(pg_set_query_timeout);
+        HHVM_FE(pg_set_typed_fetch);
         HHVM_FE(pg_transaction_status);
         HHVM_FE(pg_unescape_bytea);
         HHVM_FE(pg_version);
+        HHVM_FE(pg_wait_notify);
+        HHVM_FE(pg_wait_result);
 
 #define C(name, value) Native::registerConstant<KindOfInt64>(makeStaticString("PGSQL_" #name), (value))
         // Register constants
@@ -1753,6 +3298,9 @@ public:
         C(BAD_RESPONSE, PGRES_BAD_RESPONSE);
         C(NONFATAL_ERROR, PGRES_NONFATAL_ERROR);
         C(FATAL_ERROR, PGRES_FATAL_ERROR);
+#ifdef LIBPQ_HAS_PIPELINING
+        C(PIPELINE_ABORTED, PGRES_PIPELINE_ABORTED);
+#endif
 
         C(TRANSACTION_IDLE, PQTRANS_IDLE);
         C(TRANSACTION_ACTIVE, PQTRANS_ACTIVE);
@@ -1780,12 +3328,32 @@ public:
         C(STATUS_LONG, PGSQL_STATUS_LONG);
         C(STATUS_STRING, PGSQL_STATUS_STRING);
 
+        C(FORMAT_TEXT, PGSQL_FORMAT_TEXT);
+        C(FORMAT_BINARY, PGSQL_FORMAT_BINARY);
+
+        C(NUMERIC_STRING, PGSQL_NUMERIC_STRING);
+        C(NUMERIC_FLOAT, PGSQL_NUMERIC_FLOAT);
+
+        C(COPY_BINARY, PGSQL_COPY_BINARY);
+
         C(CONV_IGNORE_DEFAULT, 1);
         C(CONV_FORCE_NULL, 2);
         C(CONV_IGNORE_NOT_NULL, 4);
 
 #undef C
         loadSystemlib();
+
+        s_connectionPoolContainer.StartMaintenance();
+    }
+
+    virtual void moduleShutdown() {
+        s_asyncPoller.Stop();
+        s_asyncWorkers.Stop();
+        s_deadlineTimer.Stop();
+        s_connectionPoolContainer.StopMaintenance();
+        s_connectionPoolContainer.ForEachPool([](PGSQLConnectionPool* pool) {
+            pool->StopCleaning();
+        });
     }
 } s_pgsql_extension;
 
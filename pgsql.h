@@ -11,4 +11,26 @@
 #define NEWRES(type) newres<type>
 #endif
 
+namespace HPHP {
+
+// Puts a connection back in the given blocking mode on scope exit
+struct ScopeNonBlocking {
+    ScopeNonBlocking(PQ::Connection& conn, bool mode) :
+        m_conn(conn), m_mode(mode) {}
+
+    ~ScopeNonBlocking() {
+        // Left non-blocking, later synchronous calls would return before
+        // their query is sent
+        if (m_conn.isNonBlocking() != m_mode && !m_conn.setNonBlocking(m_mode)) {
+            raise_warning("Could not restore the blocking mode of the connection: %s",
+                          m_conn.errorMessage());
+        }
+    }
+
+    PQ::Connection& m_conn;
+    bool m_mode;
+};
+
+}
+
 #endif
@@ -0,0 +1,212 @@
+#include "pgsql_async.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+namespace HPHP {
+
+PGSQLAsyncPoller s_asyncPoller;
+PGSQLAsyncWorkers s_asyncWorkers;
+
+int PGSQLAsyncWorkers::MaxThreads = 4;
+
+PGSQLAsyncPoller::PGSQLAsyncPoller()
+{
+    if (pipe2(m_wakePipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        m_wakePipe[0] = m_wakePipe[1] = -1;
+}
+
+PGSQLAsyncPoller::~PGSQLAsyncPoller()
+{
+    Stop();
+
+    if (m_wakePipe[0] >= 0)
+    {
+        close(m_wakePipe[0]);
+        close(m_wakePipe[1]);
+    }
+}
+
+void PGSQLAsyncPoller::Add(PGSQLAsyncOperation* operation)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        if (!m_stopping)
+        {
+            if (!m_thread.joinable())
+                m_thread = std::thread([this] { Run(); });
+
+            m_added.push_back(operation);
+            operation = nullptr;
+        }
+    }
+
+    if (operation != nullptr)
+    {
+        // Shutting down; nobody will wait on the socket any more
+        operation->Finish();
+        return;
+    }
+
+    Wake();
+}
+
+void PGSQLAsyncPoller::Wake()
+{
+    char byte = 0;
+    while (write(m_wakePipe[1], &byte, 1) < 0 && errno == EINTR) {}
+}
+
+void PGSQLAsyncPoller::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stopping = true;
+    }
+
+    Wake();
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void PGSQLAsyncPoller::Run()
+{
+    std::vector<PGSQLAsyncOperation*> operations;
+    std::vector<struct pollfd> fds;
+
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+
+            if (m_stopping)
+                break;
+
+            operations.insert(operations.end(), m_added.begin(), m_added.end());
+            m_added.clear();
+        }
+
+        fds.resize(operations.size() + 1);
+        fds[0].fd = m_wakePipe[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+
+        bool broken = false;
+        for (size_t i = 0; i < operations.size(); i++)
+        {
+            auto& pfd = fds[i + 1];
+            pfd.fd = operations[i]->connection().socket();
+            pfd.events = POLLIN | (operations[i]->WantsWrite() ? POLLOUT : 0);
+            pfd.revents = 0;
+
+            // A connection without a socket has failed; Step() will say so
+            if (pfd.fd < 0) broken = true;
+        }
+
+        int ret = ::poll(fds.data(), fds.size(), broken ? 0 : -1);
+        if (ret < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents)
+        {
+            char buf[64];
+            while (read(m_wakePipe[0], buf, sizeof(buf)) > 0) {}
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < operations.size(); i++)
+        {
+            auto operation = operations[i];
+            bool ready = fds[i + 1].fd < 0 || fds[i + 1].revents != 0;
+
+            if (ready && operation->Step())
+                operation->Finish();
+            else
+                operations[kept++] = operation;
+        }
+        operations.resize(kept);
+    }
+
+    // Let everything still pending complete with whatever state it has
+    for (auto operation : operations)
+        operation->Finish();
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (auto operation : m_added)
+        operation->Finish();
+    m_added.clear();
+}
+
+
+void PGSQLAsyncWorkers::Add(std::function<void(bool)> job)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    if (m_stopping)
+    {
+        lock.unlock();
+        job(true);
+        return;
+    }
+
+    m_jobs.push_back(std::move(job));
+
+    if ((int)m_jobs.size() > m_idle && (int)m_threads.size() < std::max(MaxThreads, 1))
+        m_threads.emplace_back([this] { Run(); });
+    else
+        m_cond.notify_one();
+}
+
+void PGSQLAsyncWorkers::Run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (true)
+    {
+        m_idle++;
+        m_cond.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+        m_idle--;
+
+        if (m_jobs.empty())
+            break;
+
+        auto job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+
+        lock.unlock();
+        job(false);
+        lock.lock();
+    }
+}
+
+// Fails whatever is still queued and waits for the jobs being run.
+void PGSQLAsyncWorkers::Stop()
+{
+    std::deque<std::function<void(bool)>> jobs;
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        m_stopping = true;
+        jobs.swap(m_jobs);
+        m_cond.notify_all();
+    }
+
+    for (auto& job : jobs)
+        job(true);
+
+    // Nothing is added to m_threads once m_stopping is set
+    for (auto& thread : m_threads)
+    {
+        if (thread.joinable())
+            thread.join();
+    }
+}
+
+}
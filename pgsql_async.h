@@ -0,0 +1,92 @@
+#ifndef _INCL_PGSQL_ASYNC_H
+#define _INCL_PGSQL_ASYNC_H
+
+#include "pq.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Drives queries behind the Awaitables of pg_query_async and friends.
+
+namespace HPHP {
+
+// A query in flight on a connection. Once handed to the poller, only the
+// poller thread touches the operation and its connection until Finish().
+class PGSQLAsyncOperation {
+public:
+    virtual ~PGSQLAsyncOperation() {}
+
+    virtual PQ::Connection& connection() = 0;
+
+    // Whether the query still has to be flushed to the server
+    virtual bool WantsWrite() const = 0;
+
+    // Called whenever the socket is ready. Returns true once the operation
+    // is complete.
+    virtual bool Step() = 0;
+
+    // Called once Step() has returned true, after which the poller forgets
+    // the operation
+    virtual void Finish() = 0;
+};
+
+// One thread waits on the sockets of every pending operation with poll(),
+// so an awaiting request holds no thread of its own.
+class PGSQLAsyncPoller {
+public:
+    PGSQLAsyncPoller();
+    ~PGSQLAsyncPoller();
+
+    void Add(PGSQLAsyncOperation* operation);
+    void Stop();
+
+private:
+    void Run();
+    void Wake();
+
+    std::thread m_thread;
+    std::mutex m_lock; // Guards m_added and m_stopping
+    std::vector<PGSQLAsyncOperation*> m_added;
+    bool m_stopping = false;
+    int m_wakePipe[2];
+};
+
+extern PGSQLAsyncPoller s_asyncPoller;
+
+// Runs the blocking part of Awaitables that have no socket to poll yet, such
+// as a pg_pconnect_async() checkout that has to queue for or open a
+// connection. Jobs are taken in arrival order by at most MaxThreads threads,
+// so a burst of checkouts against a full pool queues here rather than
+// starting a thread each.
+class PGSQLAsyncWorkers {
+public:
+    // PGSQL.AsyncWorkerThreads
+    static int MaxThreads;
+
+    ~PGSQLAsyncWorkers() { Stop(); }
+
+    // The job is passed true instead of being run if the workers are
+    // stopping, and should then only report failure
+    void Add(std::function<void(bool)> job);
+    void Stop();
+
+private:
+    void Run();
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<std::function<void(bool)>> m_jobs;
+    int m_idle = 0; // Threads waiting for a job
+    bool m_stopping = false;
+};
+
+extern PGSQLAsyncWorkers s_asyncWorkers;
+
+}
+
+#endif//_INCL_PGSQL_ASYNC_H
@@ -0,0 +1,1358 @@
+#include "pgsql_connection_pool.h"
+
+#include "hphp/runtime/base/runtime-option.h"
+#include "hphp/runtime/base/string-util.h"
+#include "hphp/runtime/server/server-stats.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace HPHP {
+
+int  PGSQLConnectionPool::ShardCount = 0;
+
+PGSQLConnectionPoolOptions PGSQLConnectionPoolOptions::Defaults;
+
+PGSQLConnectionPoolContainer s_connectionPoolContainer;
+std::unordered_map<std::string, std::unique_ptr<PGSQLConnectionCluster>> s_connectionClusters;
+
+// Each thread is handed a shard index the first time it touches a pool and
+// keeps it for its lifetime, so a request thread keeps finding the
+// connections it released last time.
+static __thread int s_poolShard = -1;
+static std::atomic<unsigned> s_poolShardCounter(0);
+
+PGSQLConnectionPool::PGSQLConnectionPool(std::string connectionString,
+        const PGSQLConnectionPoolOptions& options)
+    :m_options(options),
+     m_connectionString(connectionString),
+     m_connections(),
+     m_cleaner(*this)
+{
+    int shards = ShardCount;
+    if (shards <= 0) {
+        shards = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    m_shardCount = shards;
+    m_shards.reset(new FreeListShard[m_shardCount]);
+}
+
+
+PGSQLConnectionPool::~PGSQLConnectionPool()
+{
+    StopMaintenance();
+    StopCleaning();
+    CloseAllConnections();
+}
+
+
+size_t PGSQLConnectionPool::HomeShard() const
+{
+    if (s_poolShard < 0) {
+        s_poolShard = s_poolShardCounter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return s_poolShard % m_shardCount;
+}
+
+
+PGSQLPooledConnection* PGSQLConnectionPool::PopFreeConnection()
+{
+    size_t home = HomeShard();
+
+    for (size_t i = 0; i < m_shardCount; i++)
+    {
+        FreeListShard& shard = m_shards[(home + i) % m_shardCount];
+
+        // Skip empty shards without touching their lock
+        if (shard.m_size.load(std::memory_order_relaxed) == 0)
+            continue;
+
+        Lock lock(shard.m_lock);
+
+        if (shard.m_connections.empty())
+            continue;
+
+        PGSQLPooledConnection* pconn = shard.m_connections.back();
+        shard.m_connections.pop_back();
+        shard.m_size--;
+        m_freeConnections--;
+
+        return pconn;
+    }
+
+    return nullptr;
+}
+
+
+void PGSQLConnectionPool::PushFreeConnection(PGSQLPooledConnection* connection)
+{
+    PushFreeConnection(connection, HomeShard());
+}
+
+
+void PGSQLConnectionPool::PushFreeConnection(PGSQLPooledConnection* connection, size_t shardIndex)
+{
+    FreeListShard& shard = m_shards[shardIndex];
+
+    Lock lock(shard.m_lock);
+
+    shard.m_connections.push_back(connection);
+    shard.m_size++;
+    m_freeConnections++;
+}
+
+
+static int64_t elapsed_us(PGSQLPooledConnection::Clock::time_point since,
+        PGSQLPooledConnection::Clock::time_point until = PGSQLPooledConnection::Clock::now()) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(until - since).count();
+}
+
+// ServerStats keys for one of the pool histograms, built once
+struct PoolStatKeys {
+    explicit PoolStatKeys(const char *name)
+        : m_count(std::string("pgsql.pool.") + name + ".count"),
+          m_time(std::string("pgsql.pool.") + name + ".us") {}
+
+    std::string m_count;
+    std::string m_time;
+};
+
+static const PoolStatKeys
+    s_checkout_stat("checkout"),
+    s_connect_stat("connect"),
+    s_use_stat("use"),
+    s_age_stat("age");
+
+static void record_pool_stat(PGSQLStats::Histogram& histogram, const PoolStatKeys& keys, int64_t us) {
+    histogram.record(us);
+
+    if (RuntimeOption::EnableStats && RuntimeOption::EnableSQLStats) {
+        ServerStats::Log(keys.m_count, 1);
+        ServerStats::Log(keys.m_time, us);
+    }
+}
+
+// Installed on connections going back to the pool, whose notices would
+// otherwise reach the released PGSQL from the cleaner or the next probe
+static void discard_notice(void *, const char *) {}
+
+PQ::Connection& PGSQLConnectionPool::GetConnection()
+{
+    PGSQLCheckoutFailure failure;
+
+    PQ::Connection* conn = TryGetConnection(failure);
+
+    if (conn == nullptr)
+        raise_error("%s", failure.m_message.c_str());
+
+    return *conn;
+}
+
+// Like GetConnection(), but reports failure to the caller instead of raising.
+PQ::Connection* PGSQLConnectionPool::TryGetConnection(PGSQLCheckoutFailure& failure)
+{
+    auto start = PGSQLPooledConnection::Clock::now();
+
+    PGSQLPooledConnection* pconn = CheckoutConnection(failure);
+
+    if (pconn == nullptr)
+        return nullptr;
+
+    m_checkedOutConnections++;
+
+    pconn->m_checkedOutAt = PGSQLPooledConnection::Clock::now();
+    record_pool_stat(m_checkoutTimes, s_checkout_stat, elapsed_us(start, pconn->m_checkedOutAt));
+
+    return pconn;
+}
+
+// Checks out an idle connection if there is one to be had without waiting
+// or connecting, and returns nullptr otherwise.
+PQ::Connection* PGSQLConnectionPool::TryGetIdleConnection()
+{
+    // Don't jump the queue while others are waiting
+    if (m_waiterCount.load() != 0)
+        return nullptr;
+
+    while (PGSQLPooledConnection* pconn = PopFreeConnection())
+    {
+        if (pconn->status() != CONNECTION_OK)
+        {
+            SweepConnection(pconn);
+            continue;
+        }
+
+        m_requestedConnections++;
+        m_checkedOutConnections++;
+
+        pconn->m_checkedOutAt = PGSQLPooledConnection::Clock::now();
+        record_pool_stat(m_checkoutTimes, s_checkout_stat, 0);
+
+        return pconn;
+    }
+
+    return nullptr;
+}
+
+PGSQLPooledConnection* PGSQLConnectionPool::CheckoutConnection(PGSQLCheckoutFailure& failure)
+{
+    // 1) free connections, own shard first
+    // 2) newconn, while under MaximumConnections
+    // 3) queue for a released connection or a freed slot
+
+    m_requestedConnections++;
+
+    while (true)
+    {
+        PGSQLPooledConnection* pconn = nullptr;
+
+        // Don't jump the queue while others are waiting
+        if (m_waiterCount.load() == 0)
+        {
+            pconn = PopFreeConnection();
+
+            if (pconn == nullptr && ReserveSlot())
+                return OpenConnection(failure);
+        }
+
+        if (pconn == nullptr)
+        {
+            bool slotReserved = false;
+            pconn = WaitForConnection(slotReserved, failure);
+
+            if (slotReserved)
+                return OpenConnection(failure);
+
+            if (pconn == nullptr)
+                return nullptr;
+        }
+
+        if (pconn->status() == CONNECTION_OK)
+        {
+            return pconn;
+        }
+
+        SweepConnection(pconn);
+    }
+}
+
+bool PGSQLConnectionPool::ReserveSlot()
+{
+    int maxConnections = MaximumConnections();
+    int slots = m_slots.load();
+
+    do {
+        if (maxConnections > 0 && slots >= maxConnections)
+            return false;
+    } while (!m_slots.compare_exchange_weak(slots, slots + 1));
+
+    return true;
+}
+
+void PGSQLConnectionPool::ReleaseSlot()
+{
+    m_slots--;
+
+    if (m_waiterCount.load() == 0)
+        return;
+
+    // Let the front waiter open a connection in the freed slot
+    std::lock_guard<std::mutex> lock(m_waitLock);
+
+    if (!m_waiters.empty())
+    {
+        Waiter* waiter = m_waiters.front();
+        m_waiters.pop_front();
+        m_waiterCount--;
+
+        waiter->m_slotFreed = true;
+        waiter->m_cond.notify_one();
+    }
+}
+
+// Opens a connection in a slot the caller has already reserved.
+PGSQLPooledConnection* PGSQLConnectionPool::OpenConnection(PGSQLCheckoutFailure& failure)
+{
+    if (RuntimeOption::EnableStats && RuntimeOption::EnableSQLStats) {
+        ServerStats::Log("sql.conn", 1);
+    }
+
+    PGSQLPooledConnection* pconn = PGSQLPooledConnection::Connect(GetConnectionString());
+
+    if (pconn->status() != CONNECTION_OK)
+    {
+        m_errors++;
+
+        delete pconn;
+        ReleaseSlot();
+
+        failure.m_message = "Getting connection from pool failed.";
+        failure.m_serverDown = true;
+        return nullptr;
+    }
+
+    m_openedConnections++;
+    record_pool_stat(m_connectTimes, s_connect_stat, elapsed_us(pconn->m_openedAt));
+
+    AddConnection(pconn);
+
+    return pconn;
+}
+
+// Queues the calling thread until a connection is handed to it, a slot to
+// open a new one frees up, or WaitTimeout passes. Free lists are only
+// re-checked by the front waiter, under m_waitLock, so that a connection
+// released just before the waiter was queued is not missed.
+PGSQLPooledConnection* PGSQLConnectionPool::WaitForConnection(bool& slotReserved,
+        PGSQLCheckoutFailure& failure)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    if (m_options.WaitTimeout <= 0)
+    {
+        failure.m_message = "The connection pool is full, cannot open new connection.";
+        return nullptr;
+    }
+
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::milliseconds(m_options.WaitTimeout);
+
+    std::unique_lock<std::mutex> lock(m_waitLock);
+
+    if (m_options.MaxWaiters >= 0 && (int)m_waiters.size() >= m_options.MaxWaiters)
+    {
+        lock.unlock();
+        m_waitTimeouts++;
+        failure.m_message = "The connection pool is full and its wait queue is too, cannot open new connection.";
+        return nullptr;
+    }
+
+    Waiter waiter;
+    m_waiters.push_back(&waiter);
+    m_waiterCount++;
+    m_waitedConnections++;
+
+    PGSQLPooledConnection* pconn = nullptr;
+    bool timedOut = false;
+
+    while (true)
+    {
+        if (waiter.m_connection != nullptr)
+        {
+            pconn = waiter.m_connection;
+            break;
+        }
+
+        if (waiter.m_slotFreed)
+        {
+            // Someone else may have taken the slot meanwhile; keep our place
+            waiter.m_slotFreed = false;
+            m_waiters.push_front(&waiter);
+            m_waiterCount++;
+        }
+
+        if (m_waiters.front() == &waiter)
+        {
+            if ((pconn = PopFreeConnection()) != nullptr)
+                break;
+
+            if ((slotReserved = ReserveSlot()))
+                break;
+        }
+
+        if (timedOut)
+            break;
+
+        timedOut = waiter.m_cond.wait_until(lock, deadline) == std::cv_status::timeout;
+    }
+
+    // Still queued unless a releaser handed us a connection or slot
+    auto self = std::find(m_waiters.begin(), m_waiters.end(), &waiter);
+    if (self != m_waiters.end())
+    {
+        m_waiters.erase(self);
+        m_waiterCount--;
+    }
+
+    lock.unlock();
+
+    m_waitTime += std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - start).count();
+
+    if (pconn == nullptr && !slotReserved)
+    {
+        m_waitTimeouts++;
+        failure.m_message = "Timed out after " + std::to_string(m_options.WaitTimeout) +
+            " ms waiting for a connection from the pool.";
+        return nullptr;
+    }
+
+    // Whoever is next in line may be able to go too
+    HandOffToWaiters();
+
+    return pconn;
+}
+
+// Passes free connections to queued checkouts, oldest first.
+void PGSQLConnectionPool::HandOffToWaiters()
+{
+    if (m_waiterCount.load() == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_waitLock);
+
+    while (!m_waiters.empty())
+    {
+        PGSQLPooledConnection* pconn = PopFreeConnection();
+        if (pconn == nullptr)
+            break;
+
+        Waiter* waiter = m_waiters.front();
+        m_waiters.pop_front();
+        m_waiterCount--;
+
+        waiter->m_connection = pconn;
+        waiter->m_cond.notify_one();
+    }
+}
+
+void PGSQLConnectionPool::AddConnection(PGSQLPooledConnection* pconn)
+{
+    Lock lock(m_lock);
+
+    m_connections.push_back(pconn);
+    m_totalConnections++;
+
+    if (m_cleanedConnectionString == "")
+    {
+        m_cleanedConnectionString.append("host=");
+        m_cleanedConnectionString.append(pconn->host());
+        m_cleanedConnectionString.append(" port=");
+        m_cleanedConnectionString.append(pconn->port());
+        m_cleanedConnectionString.append(" user=");
+        m_cleanedConnectionString.append(pconn->user());
+        m_cleanedConnectionString.append(" dbname=");
+        m_cleanedConnectionString.append(pconn->db());
+    }
+}
+
+std::string PGSQLConnectionPool::GetCleanedConnectionString()
+{
+    Lock lock(m_lock);
+
+    return m_cleanedConnectionString;
+}
+
+// Closes and forgets a connection that is not in any free list.
+void PGSQLConnectionPool::SweepConnection(PGSQLPooledConnection* connection)
+{
+    bool found;
+
+    {
+        Lock lock(m_lock);
+
+        auto p = std::find(m_connections.begin(), m_connections.end(), connection);
+
+        found = p != m_connections.end();
+
+        if (found)
+        {
+            m_connections.erase(p);
+            m_totalConnections--;
+        }
+    }
+
+    m_sweepedConnections++;
+    record_pool_stat(m_connectionAges, s_age_stat, elapsed_us(connection->m_openedAt));
+
+    delete connection;
+
+    if (found)
+        ReleaseSlot();
+
+    if (MinIdle() > 0)
+        WakeMaintenance();
+}
+
+void PGSQLConnectionPool::Release(PQ::Connection& connection, bool dropStatements)
+{
+    // Every connection handed out by GetConnection() is a pooled one
+    auto pconn = static_cast<PGSQLPooledConnection*>(&connection);
+
+    // DISCARD ALL drops them anyway
+    pconn->m_dropStatements = dropStatements && !m_options.ResetSession;
+
+    m_releasedConnections++;
+    m_checkedOutConnections--;
+    record_pool_stat(m_useTimes, s_use_stat, elapsed_us(pconn->m_checkedOutAt));
+
+    pconn->setNoticeProcessor<void>(discard_notice, nullptr);
+
+    if (pconn->status() != CONNECTION_OK) {
+
+        SweepConnection(pconn);
+
+    } else if (pconn->transactionStatus() == PQTRANS_IDLE && !pconn->inPipeline() &&
+               !pconn->m_dropStatements && !m_options.ResetSession) {
+
+        // The request that just used it has shown it to be alive
+        pconn->m_idleSince = pconn->m_validatedAt = PGSQLPooledConnection::Clock::now();
+        PushFreeConnection(pconn);
+        HandOffToWaiters();
+
+    } else {
+
+        // Left mid-transaction, with a query in flight or unread results,
+        // in pipeline mode, with statements to drop, or due a session reset
+        m_cleaningConnections++;
+        m_cleaner.Enqueue(pconn);
+
+    }
+}
+
+void PGSQLConnectionPool::CloseAllConnections()
+{
+    for (size_t i = 0; i < m_shardCount; i++)
+    {
+        FreeListShard& shard = m_shards[i];
+        Lock lock(shard.m_lock);
+
+        m_freeConnections -= (int)shard.m_connections.size();
+        shard.m_connections.clear();
+        shard.m_size = 0;
+    }
+
+    Lock lock(m_lock);
+
+    for (PGSQLPooledConnection* conn : m_connections)
+        conn->finish();
+
+    m_slots -= (int)m_connections.size();
+    m_connections.clear();
+    m_totalConnections = 0;
+}
+
+
+void PGSQLConnectionPool::CloseFreeConnections()
+{
+    for (size_t i = 0; i < m_shardCount; i++)
+    {
+        std::vector<PGSQLPooledConnection*> closing;
+
+        {
+            FreeListShard& shard = m_shards[i];
+            Lock lock(shard.m_lock);
+
+            closing.swap(shard.m_connections);
+            shard.m_size = 0;
+            m_freeConnections -= (int)closing.size();
+        }
+
+        for (PGSQLPooledConnection* pconn : closing)
+            SweepConnection(pconn);
+    }
+}
+
+
+// Opens up to `count` connections concurrently and adds them to the free
+// lists. All handshakes are multiplexed over a single poll() loop, so the
+// whole batch costs roughly one connection's worth of latency. Returns the
+// number of connections that were opened.
+int PGSQLConnectionPool::OpenConnections(int count)
+{
+    if (count <= 0)
+        return 0;
+
+    struct PendingConnection {
+        PGSQLPooledConnection* conn;
+        PostgresPollingStatusType state;
+    };
+
+    std::vector<PendingConnection> pending;
+    pending.reserve(count);
+
+    // Stop at MaximumConnections
+    for (int i = 0; i < count && ReserveSlot(); i++)
+    {
+        PGSQLPooledConnection* pconn = PGSQLPooledConnection::Start(GetConnectionString());
+
+        if (!*pconn || pconn->status() == CONNECTION_BAD)
+        {
+            m_errors++;
+            delete pconn;
+            ReleaseSlot();
+            continue;
+        }
+
+        // A freshly started connection waits for its socket to be writable
+        pending.push_back({pconn, PGRES_POLLING_WRITING});
+    }
+
+    auto deadline = std::chrono::steady_clock::now() +
+        std::chrono::seconds(m_options.ConnectTimeout);
+
+    std::vector<struct pollfd> fds;
+    int opened = 0;
+
+    while (!pending.empty())
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+
+        if (remaining <= 0)
+            break;
+
+        fds.resize(pending.size());
+        for (size_t i = 0; i < pending.size(); i++)
+        {
+            fds[i].fd = pending[i].conn->socket();
+            fds[i].events = pending[i].state == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+            fds[i].revents = 0;
+        }
+
+        int ready = poll(fds.data(), fds.size(), (int)remaining);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        // Walk backwards so finished entries can be removed in place
+        for (size_t i = pending.size(); i-- > 0;)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            PendingConnection& p = pending[i];
+            p.state = p.conn->connectPoll();
+
+            if (p.state == PGRES_POLLING_OK)
+            {
+                m_openedConnections++;
+                opened++;
+
+                p.conn->m_idleSince = p.conn->m_validatedAt =
+                    PGSQLPooledConnection::Clock::now();
+                record_pool_stat(m_connectTimes, s_connect_stat,
+                    elapsed_us(p.conn->m_openedAt, p.conn->m_idleSince));
+
+                AddConnection(p.conn);
+                PushFreeConnection(p.conn);
+                HandOffToWaiters();
+            }
+            else if (p.state == PGRES_POLLING_FAILED)
+            {
+                m_errors++;
+                delete p.conn;
+                ReleaseSlot();
+            }
+            else
+            {
+                continue;
+            }
+
+            pending.erase(pending.begin() + i);
+        }
+    }
+
+    // Whatever is still pending has run out of time
+    for (PendingConnection& p : pending)
+    {
+        m_errors++;
+        delete p.conn;
+        ReleaseSlot();
+    }
+
+    if (opened > 0 && RuntimeOption::EnableStats && RuntimeOption::EnableSQLStats) {
+        ServerStats::Log("sql.conn", opened);
+    }
+
+    return opened;
+}
+
+void PGSQLConnectionPool::FillMinIdle()
+{
+    int missing = MinIdle() - FreeConnectionsCount();
+
+    if (missing > 0)
+        OpenConnections(missing);
+}
+
+// Reads every pending result, waiting at most timeoutMs for each. Returns
+// false if the connection could not be brought back to idle; a COPY in
+// progress counts as that.
+static bool drain_results(PQ::Connection& conn, int timeoutMs,
+        ExecStatusType *lastStatus = nullptr) {
+    while (true) {
+        if (!conn.waitResult(timeoutMs)) return false;
+
+        PQ::Result res = conn.result();
+        if (!res) return true;
+
+        ExecStatusType st = res.status();
+        if (lastStatus) *lastStatus = st;
+
+        if (st == PGRES_COPY_IN || st == PGRES_COPY_OUT || st == PGRES_COPY_BOTH) {
+            return false;
+        }
+    }
+}
+
+// Runs `command` without ever blocking on the socket for longer than
+// timeoutMs at a time, for use on connections whose peer may be gone.
+static bool exec_with_timeout(PQ::Connection& conn, const char *command,
+        int timeoutMs, ExecStatusType expected) {
+    ScopeNonBlocking nb(conn, conn.isNonBlocking());
+    conn.setNonBlocking(true);
+
+    ExecStatusType st = PGRES_FATAL_ERROR;
+
+    if (!conn.sendQuery(command) ||
+        !conn.flushWait(timeoutMs) ||
+        !drain_results(conn, timeoutMs, &st)) {
+        return false;
+    }
+
+    return st == expected && conn.status() == CONNECTION_OK;
+}
+
+// Takes the connection out of pipeline mode, discarding the results of
+// anything still queued. The sync sent first makes the server answer
+// queries that were never synced; libpq only lets the pipeline close once
+// every result has been read.
+static bool exit_pipeline(PQ::Connection& conn, int timeoutMs) {
+    ScopeNonBlocking nb(conn, conn.isNonBlocking());
+    conn.setNonBlocking(true);
+
+    if (!conn.pipelineSync() || !conn.flushWait(timeoutMs)) return false;
+
+    while (!conn.exitPipeline()) {
+        if (conn.status() != CONNECTION_OK || !conn.waitResult(timeoutMs)) return false;
+
+        PQ::Result res = conn.result();
+        if (res && (res.status() == PGRES_COPY_IN || res.status() == PGRES_COPY_OUT ||
+                    res.status() == PGRES_COPY_BOTH)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Sends an empty query and waits for its reply, without blocking past the
+// connect timeout if the peer has silently gone away.
+bool PGSQLConnectionPool::ProbeConnection(PGSQLPooledConnection* pconn)
+{
+    if (pconn->status() != CONNECTION_OK)
+        return false;
+
+    return exec_with_timeout(*pconn, "", m_options.ConnectTimeout * 1000, PGRES_EMPTY_QUERY);
+}
+
+// Brings a released connection back to an idle session. Runs on the
+// cleaner thread.
+bool PGSQLConnectionPool::CleanConnection(PGSQLPooledConnection* pconn)
+{
+    int timeoutMs = m_options.ConnectTimeout * 1000;
+
+    if (pconn->inPipeline())
+    {
+        if (pconn->transactionStatus() == PQTRANS_ACTIVE)
+            pconn->cancel();
+
+        if (!exit_pipeline(*pconn, timeoutMs))
+            return false;
+    }
+
+    if (pconn->transactionStatus() == PQTRANS_ACTIVE)
+    {
+        // A query is still running or its results were never read
+        pconn->cancel();
+
+        ScopeNonBlocking nb(*pconn, pconn->isNonBlocking());
+        pconn->setNonBlocking(true);
+
+        if (!pconn->flushWait(timeoutMs) || !drain_results(*pconn, timeoutMs))
+            return false;
+    }
+
+    switch (pconn->transactionStatus())
+    {
+        case PQTRANS_IDLE:
+            break;
+        case PQTRANS_INTRANS:
+        case PQTRANS_INERROR:
+            if (!exec_with_timeout(*pconn, "ROLLBACK", timeoutMs, PGRES_COMMAND_OK))
+                return false;
+            break;
+        default:
+            return false;
+    }
+
+    if (pconn->m_dropStatements)
+    {
+        if (!exec_with_timeout(*pconn, "CLOSE ALL; DEALLOCATE ALL", timeoutMs, PGRES_COMMAND_OK))
+            return false;
+
+        pconn->m_dropStatements = false;
+    }
+
+    if (m_options.ResetSession &&
+        !exec_with_timeout(*pconn, "DISCARD ALL", timeoutMs, PGRES_COMMAND_OK))
+        return false;
+
+    return pconn->status() == CONNECTION_OK &&
+        pconn->transactionStatus() == PQTRANS_IDLE;
+}
+
+void PGSQLConnectionPool::FinishCleaning(PGSQLPooledConnection* pconn)
+{
+    if (CleanConnection(pconn))
+    {
+        m_cleanedConnections++;
+
+        pconn->m_idleSince = pconn->m_validatedAt = PGSQLPooledConnection::Clock::now();
+        PushFreeConnection(pconn);
+        HandOffToWaiters();
+    }
+    else
+    {
+        m_errors++;
+        SweepConnection(pconn);
+    }
+
+    m_cleaningConnections--;
+}
+
+// One maintenance pass over the free lists. Connections past MaxLifetime
+// are closed, connections idle for longer than IdleTimeout are closed while
+// the pool has more than MinIdle free ones, and the rest are probed once
+// every KeepaliveInterval. Each shard is only locked while its list is
+// partitioned, never across the network round trip of a probe.
+void PGSQLConnectionPool::ReapConnections()
+{
+    typedef PGSQLPooledConnection::Clock Clock;
+
+    auto now = Clock::now();
+    auto idleTimeout = std::chrono::seconds(m_options.IdleTimeout);
+    auto maxLifetime = std::chrono::seconds(m_options.MaxLifetime);
+    auto keepalive = std::chrono::seconds(m_options.KeepaliveInterval);
+
+    for (size_t i = 0; i < m_shardCount; i++)
+    {
+        std::vector<PGSQLPooledConnection*> closing;
+        std::vector<PGSQLPooledConnection*> probing;
+
+        {
+            FreeListShard& shard = m_shards[i];
+            Lock lock(shard.m_lock);
+
+            auto& conns = shard.m_connections;
+
+            for (auto it = conns.begin(); it != conns.end();)
+            {
+                PGSQLPooledConnection* pconn = *it;
+
+                if (m_options.MaxLifetime > 0 && now - pconn->m_openedAt >= maxLifetime)
+                {
+                    closing.push_back(pconn);
+                }
+                else if (m_options.IdleTimeout > 0 && now - pconn->m_idleSince >= idleTimeout &&
+                         FreeConnectionsCount() > MinIdle())
+                {
+                    closing.push_back(pconn);
+                }
+                else if (m_options.KeepaliveInterval > 0 && now - pconn->m_validatedAt >= keepalive)
+                {
+                    probing.push_back(pconn);
+                }
+                else
+                {
+                    ++it;
+                    continue;
+                }
+
+                it = conns.erase(it);
+                shard.m_size--;
+                m_freeConnections--;
+            }
+        }
+
+        for (PGSQLPooledConnection* pconn : closing)
+            SweepConnection(pconn);
+
+        for (PGSQLPooledConnection* pconn : probing)
+        {
+            if (ProbeConnection(pconn))
+            {
+                pconn->m_validatedAt = Clock::now();
+
+                PushFreeConnection(pconn, i);
+                HandOffToWaiters();
+            }
+            else
+            {
+                m_errors++;
+                SweepConnection(pconn);
+            }
+        }
+    }
+}
+
+void PGSQLConnectionPool::WakeMaintenance()
+{
+    std::lock_guard<std::mutex> lock(m_maintenanceLock);
+
+    m_maintenanceWakeup = true;
+    m_maintenanceCond.notify_one();
+}
+
+void PGSQLConnectionPool::MaintenanceLoop()
+{
+    std::unique_lock<std::mutex> lock(m_maintenanceLock);
+
+    while (!m_maintenanceStopping)
+    {
+        lock.unlock();
+
+        ReapConnections();
+        FillMinIdle();
+
+        lock.lock();
+
+        m_maintenanceCond.wait_for(lock,
+            std::chrono::milliseconds(m_options.MaintenanceInterval),
+            [this] { return m_maintenanceStopping || m_maintenanceWakeup; });
+
+        m_maintenanceWakeup = false;
+    }
+}
+
+void PGSQLConnectionPool::StartMaintenance()
+{
+    if (!m_options.NeedsMaintenance() || m_maintenanceThread.joinable())
+        return;
+
+    m_maintenanceStopping = false;
+    m_maintenanceThread = std::thread([this] { MaintenanceLoop(); });
+}
+
+void PGSQLConnectionPool::StopMaintenance()
+{
+    if (!m_maintenanceThread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_maintenanceLock);
+
+        m_maintenanceStopping = true;
+        m_maintenanceCond.notify_one();
+    }
+
+    m_maintenanceThread.join();
+}
+
+
+void PGSQLConnectionCleaner::Enqueue(PGSQLPooledConnection* connection)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (m_stopping)
+    {
+        m_pool.SweepConnection(connection);
+        m_pool.m_cleaningConnections--;
+        return;
+    }
+
+    if (!m_thread.joinable())
+        m_thread = std::thread([this] { Run(); });
+
+    m_queue.push_back(connection);
+    m_cond.notify_one();
+}
+
+void PGSQLConnectionCleaner::Run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (true)
+    {
+        m_cond.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+
+        if (m_queue.empty())
+            break;
+
+        PGSQLPooledConnection* connection = m_queue.front();
+        m_queue.pop_front();
+
+        lock.unlock();
+        m_pool.FinishCleaning(connection);
+        lock.lock();
+    }
+}
+
+// Cleans whatever is still queued, then stops the thread.
+void PGSQLConnectionCleaner::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        m_stopping = true;
+        m_cond.notify_one();
+    }
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+
+PGSQLConnectionPoolContainer::PGSQLConnectionPoolContainer()
+    :m_pools() {
+    m_snapshots.emplace_back(new Snapshot());
+    m_snapshot.store(m_snapshots.back().get());
+}
+
+
+PGSQLConnectionPoolContainer::~PGSQLConnectionPoolContainer() {
+    ForEachPool([](PGSQLConnectionPool* pool) {
+        pool->CloseAllConnections();
+    });
+}
+
+
+// FNV-1a
+size_t PGSQLConnectionPoolContainer::Hash(const char *connString, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)connString[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return (size_t)hash;
+}
+
+
+PGSQLConnectionPool* PGSQLConnectionPoolContainer::Snapshot::Find(const char *connString,
+        size_t len, size_t hash) const
+{
+    if (entries.empty())
+        return nullptr;
+
+    size_t mask = entries.size() - 1;
+
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        const Entry& entry = entries[i];
+
+        if (entry.pool == nullptr)
+            return nullptr;
+
+        if (entry.hash == hash &&
+            entry.connString.size() == len &&
+            memcmp(entry.connString.data(), connString, len) == 0)
+            return entry.pool;
+    }
+}
+
+
+void PGSQLConnectionPoolContainer::Snapshot::Insert(size_t hash,
+        const std::string& connString, PGSQLConnectionPool* pool)
+{
+    size_t mask = entries.size() - 1;
+    size_t i = hash & mask;
+
+    while (entries[i].pool != nullptr)
+        i = (i + 1) & mask;
+
+    entries[i] = Entry{hash, connString, pool};
+}
+
+
+// Publishes a copy of the current snapshot that also maps connString to
+// pool. Must be called with m_lock held.
+void PGSQLConnectionPoolContainer::Publish(const std::string& connString,
+        PGSQLConnectionPool* pool, bool created)
+{
+    const Snapshot* current = m_snapshot.load(std::memory_order_relaxed);
+
+    bool alias = current->aliasCount < MaxPublishedAliases;
+
+    if (!alias && !created)
+        return;
+
+    std::unique_ptr<Snapshot> next(new Snapshot());
+
+    next->pools = current->pools;
+    if (created)
+        next->pools.push_back(pool);
+
+    next->aliasCount = current->aliasCount + (alias ? 1 : 0);
+
+    size_t size = 8;
+    while (size < next->aliasCount * 2)
+        size *= 2;
+
+    next->entries.resize(size, Snapshot::Entry{0, std::string(), nullptr});
+
+    for (auto& entry : current->entries)
+    {
+        if (entry.pool != nullptr)
+            next->Insert(entry.hash, entry.connString, entry.pool);
+    }
+
+    if (alias)
+        next->Insert(Hash(connString.data(), connString.size()), connString, pool);
+
+    m_snapshot.store(next.get(), std::memory_order_release);
+    m_snapshots.push_back(std::move(next));
+}
+
+
+// Reduces a connection string to a key that is the same for every spelling
+// of the same connection: options in libpq's fixed order, defaults left out,
+// values quoted the same way, and the password replaced by its hash so it
+// never shows up in a key. Strings libpq cannot parse are used as they are
+// and will fail to connect with libpq's own error.
+static std::string canonical_conninfo(const std::string& connString)
+{
+    char *errmsg = nullptr;
+    PQconninfoOption *options = PQconninfoParse(connString.c_str(), &errmsg);
+
+    if (options == nullptr)
+    {
+        if (errmsg) PQfreemem(errmsg);
+        return connString;
+    }
+
+    std::string key;
+
+    for (PQconninfoOption *opt = options; opt->keyword; opt++)
+    {
+        if (opt->val == nullptr)
+            continue;
+
+        std::string val = opt->val;
+
+        if (strcmp(opt->keyword, "password") == 0)
+            val = StringUtil::SHA1(String(val)).toCppString();
+
+        if (!key.empty())
+            key.push_back(' ');
+
+        key.append(opt->keyword);
+        key.append("='");
+
+        for (char c : val)
+        {
+            if (c == '\\' || c == '\'')
+                key.push_back('\\');
+            key.push_back(c);
+        }
+
+        key.push_back('\'');
+    }
+
+    PQconninfoFree(options);
+
+    return key;
+}
+
+
+// Must be called with m_lock held.
+PGSQLConnectionPool* PGSQLConnectionPoolContainer::FindPool(const std::string& connString,
+        const PGSQLConnectionPoolOptions& options, bool& created)
+{
+    created = false;
+
+    const Snapshot* snapshot = m_snapshot.load(std::memory_order_relaxed);
+    auto found = snapshot->Find(connString.data(), connString.size(),
+                                Hash(connString.data(), connString.size()));
+    if (found != nullptr)
+        return found;
+
+    auto alias = m_aliases.find(connString);
+    if (alias != m_aliases.end())
+        return alias->second;
+
+    std::string key = canonical_conninfo(connString);
+
+    auto& pool = m_pools[key];
+
+    if (pool == nullptr)
+    {
+        pool = new PGSQLConnectionPool(connString, options);
+        created = true;
+    }
+
+    bool published = created || snapshot->aliasCount < MaxPublishedAliases;
+
+    Publish(connString, pool, created);
+
+    // Spellings are normally a handful of literals, but don't let a caller
+    // building strings on the fly grow this without bound
+    if (!published && m_aliases.size() < MaxAliases)
+        m_aliases.emplace(connString, pool);
+
+    return pool;
+}
+
+
+PGSQLConnectionPool& PGSQLConnectionPoolContainer::GetPool(const char *connString, size_t len)
+{
+    const Snapshot* snapshot = m_snapshot.load(std::memory_order_acquire);
+
+    auto pool = snapshot->Find(connString, len, Hash(connString, len));
+    if (pool != nullptr)
+        return *pool;
+
+    return GetPool(std::string(connString, len));
+}
+
+
+PGSQLConnectionPool& PGSQLConnectionPoolContainer::GetPool(const std::string connString)
+{
+    Lock lock(m_lock);
+
+    bool created;
+    auto pool = FindPool(connString, PGSQLConnectionPoolOptions::Defaults, created);
+
+    if (created)
+        pool->StartMaintenance();
+
+    return *pool;
+}
+
+
+
+// Registers a pool declared in the PGSQL.Pools configuration section
+PGSQLConnectionPool& PGSQLConnectionPoolContainer::AddPool(const std::string connString,
+        const PGSQLConnectionPoolOptions& options)
+{
+    Lock lock(m_lock);
+
+    bool created;
+    return *FindPool(connString, options, created);
+}
+
+
+void PGSQLConnectionPoolContainer::StartMaintenance()
+{
+    Lock lock(m_lock);
+
+    ForEachPool([](PGSQLConnectionPool* pool) {
+        pool->StartMaintenance();
+    });
+}
+
+
+void PGSQLConnectionPoolContainer::StopMaintenance()
+{
+    Lock lock(m_lock);
+
+    ForEachPool([](PGSQLConnectionPool* pool) {
+        pool->StopMaintenance();
+    });
+}
+
+
+void PGSQLConnectionCluster::AddHost(PGSQLConnectionPool& pool, bool primary, int weight)
+{
+    m_hosts.emplace_back(new Host());
+
+    Host& host = *m_hosts.back();
+    host.m_pool = &pool;
+    host.m_primary = primary;
+    host.m_weight = weight > 0 ? weight : 1;
+}
+
+bool PGSQLConnectionCluster::TryHost(Host& host, Clock::rep now, PQ::Connection*& conn,
+        PGSQLCheckoutFailure& failure)
+{
+    failure = PGSQLCheckoutFailure();
+    conn = host.m_pool->TryGetConnection(failure);
+
+    if (conn != nullptr)
+    {
+        host.m_ejectedUntil.store(0);
+        return true;
+    }
+
+    // A full pool is busy, not broken
+    if (failure.m_serverDown)
+    {
+        auto eject = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::seconds(m_ejectSeconds));
+        host.m_ejectedUntil.store(now + eject.count());
+    }
+
+    return false;
+}
+
+PQ::Connection* PGSQLConnectionCluster::GetConnection(bool readOnly,
+        PGSQLConnectionPool*& pool, PGSQLCheckoutFailure& failure)
+{
+    Clock::rep now = Clock::now().time_since_epoch().count();
+
+    // Hosts in the order they should be tried: in-rotation replicas by
+    // load for reads, then primaries in declaration order, then anything
+    // ejected as a last resort
+    std::vector<Host*> order;
+    std::vector<Host*> ejected;
+    order.reserve(m_hosts.size());
+
+    if (readOnly)
+    {
+        for (auto& host : m_hosts)
+        {
+            if (host->m_primary)
+                continue;
+
+            if (host->m_ejectedUntil.load() > now)
+                ejected.push_back(host.get());
+            else
+                order.push_back(host.get());
+        }
+
+        // Least outstanding per unit of weight; ties keep declaration order
+        std::stable_sort(order.begin(), order.end(), [](const Host* a, const Host* b) {
+            return (int64_t)a->m_pool->CheckedOutConnectionsCount() * b->m_weight <
+                (int64_t)b->m_pool->CheckedOutConnectionsCount() * a->m_weight;
+        });
+    }
+
+    for (auto& host : m_hosts)
+    {
+        if (!host->m_primary)
+            continue;
+
+        if (host->m_ejectedUntil.load() > now)
+            ejected.push_back(host.get());
+        else
+            order.push_back(host.get());
+    }
+
+    order.insert(order.end(), ejected.begin(), ejected.end());
+
+    if (order.empty())
+    {
+        failure.m_message = readOnly ? "The cluster has no hosts." : "The cluster has no primary.";
+        return nullptr;
+    }
+
+    PQ::Connection* conn = nullptr;
+
+    for (auto host : order)
+    {
+        if (TryHost(*host, now, conn, failure))
+        {
+            pool = host->m_pool;
+            return conn;
+        }
+    }
+
+    return nullptr;
+}
+
+}
@@ -0,0 +1,373 @@
+#ifndef _INCL_PGSQL_CONNECTION_POOL_H
+#define _INCL_PGSQL_CONNECTION_POOL_H
+
+#include "pgsql.h"
+#include "pgsql_histogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Connection pools shared by pg_pconnect and persistent PDO connections.
+
+namespace HPHP {
+
+class PGSQLConnectionPool;
+
+// Why a checkout failed, for callers that try another pool instead of
+// raising
+struct PGSQLCheckoutFailure {
+    std::string m_message;
+    // Connecting to the server failed, rather than the pool being full
+    bool m_serverDown = false;
+};
+
+struct PGSQLConnectionPoolOptions {
+    int MaximumConnections = -1;
+    // Idle connections the pool keeps open ahead of demand
+    int MinIdle = 0;
+    // Seconds allowed for each background connection attempt
+    int ConnectTimeout = 30;
+    // Milliseconds between background maintenance passes
+    int MaintenanceInterval = 1000;
+    // Seconds a connection may sit idle before it is closed, down to MinIdle
+    int IdleTimeout = 0;
+    // Seconds after which a connection is retired once it is next idle
+    int MaxLifetime = 0;
+    // Seconds between liveness probes of an idle connection
+    int KeepaliveInterval = 0;
+    // Milliseconds a checkout may wait for a connection once the pool is at
+    // MaximumConnections; 0 fails straight away
+    int WaitTimeout = 0;
+    // Checkouts allowed to queue at once, -1 for no limit
+    int MaxWaiters = -1;
+    // Run DISCARD ALL on every released connection
+    bool ResetSession = false;
+
+    // Applied to pools that pg_pconnect creates on demand
+    static PGSQLConnectionPoolOptions Defaults;
+
+    bool NeedsMaintenance() const {
+        return MinIdle > 0 || IdleTimeout > 0 || MaxLifetime > 0 ||
+            KeepaliveInterval > 0;
+    }
+};
+
+// A pooled connection carries the timestamps the maintenance thread uses
+// to decide when to probe or retire it.
+class PGSQLPooledConnection : public PQ::Connection {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    static PGSQLPooledConnection *Connect(const std::string& conninfo) {
+        return new PGSQLPooledConnection(PQconnectdb(conninfo.c_str()));
+    }
+
+    static PGSQLPooledConnection *Start(const std::string& conninfo) {
+        return new PGSQLPooledConnection(PQconnectStart(conninfo.c_str()));
+    }
+
+    Clock::time_point m_openedAt;
+    Clock::time_point m_idleSince;
+    Clock::time_point m_validatedAt;
+    Clock::time_point m_checkedOutAt;
+
+    // The cleaner drops the session's prepared statements and cursors
+    // before the connection is reused
+    bool m_dropStatements = false;
+
+private:
+    explicit PGSQLPooledConnection(PGconn *conn)
+        : PQ::Connection(conn),
+          m_openedAt(Clock::now()),
+          m_idleSince(m_openedAt),
+          m_validatedAt(m_openedAt) {}
+};
+
+class PGSQLConnectionPoolContainer {
+private:
+    // An immutable view of the registry. Lookups read the current one
+    // without taking any lock; changes publish a modified copy under m_lock.
+    // Replaced snapshots are kept until the container is destroyed, since a
+    // reader may still be walking one.
+    struct Snapshot {
+        struct Entry {
+            size_t hash;
+            std::string connString;
+            PGSQLConnectionPool* pool; // nullptr for an empty slot
+        };
+
+        // Open addressed, a power of two in size and at most half full
+        std::vector<Entry> entries;
+        std::vector<PGSQLConnectionPool*> pools;
+        size_t aliasCount = 0;
+
+        PGSQLConnectionPool* Find(const char *connString, size_t len, size_t hash) const;
+        void Insert(size_t hash, const std::string& connString, PGSQLConnectionPool* pool);
+    };
+
+    std::atomic<const Snapshot*> m_snapshot;
+    std::vector<std::unique_ptr<const Snapshot>> m_snapshots;
+
+    // Keyed on the canonical form of the connection string
+    std::map<std::string, PGSQLConnectionPool*> m_pools;
+    // Spellings that didn't fit in the snapshot
+    std::unordered_map<std::string, PGSQLConnectionPool*> m_aliases;
+    Mutex m_lock; // Guards everything but m_snapshot
+
+    // Every published alias costs a copy of the table, so only the first
+    // few spellings get the lock-free path
+    static const size_t MaxPublishedAliases = 256;
+    static const size_t MaxAliases = 4096;
+
+    static size_t Hash(const char *connString, size_t len);
+
+    PGSQLConnectionPool* FindPool(const std::string& connString,
+            const PGSQLConnectionPoolOptions& options, bool& created);
+    void Publish(const std::string& connString, PGSQLConnectionPool* pool, bool created);
+
+public:
+    PGSQLConnectionPoolContainer();
+    PGSQLConnectionPoolContainer(PGSQLConnectionPoolContainer const&);
+    void operator=(PGSQLConnectionPoolContainer const&);
+
+    ~PGSQLConnectionPoolContainer();
+
+    PGSQLConnectionPool& GetPool(const char *connString, size_t len);
+    PGSQLConnectionPool& GetPool(const std::string);
+    PGSQLConnectionPool& AddPool(const std::string, const PGSQLConnectionPoolOptions&);
+
+    // Calls f on every pool, without locking or allocating
+    template<class F>
+    void ForEachPool(F f) const {
+        for (auto pool : m_snapshot.load(std::memory_order_acquire)->pools)
+            f(pool);
+    }
+
+    void StartMaintenance();
+    void StopMaintenance();
+
+};
+
+
+
+// Performs the round trips needed to make a released connection reusable
+// (cancel and drain, ROLLBACK, DEALLOCATE ALL, DISCARD ALL) on a background
+// thread, so the end of a request never waits on them. Each pool has its
+// own, so a dead peer holding up one pool's cleanup can't stall the others.
+class PGSQLConnectionCleaner {
+public:
+    explicit PGSQLConnectionCleaner(PGSQLConnectionPool& pool) : m_pool(pool) {}
+    ~PGSQLConnectionCleaner() { Stop(); }
+
+    void Enqueue(PGSQLPooledConnection* connection);
+    void Stop();
+
+private:
+    void Run();
+
+    PGSQLConnectionPool& m_pool;
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::deque<PGSQLPooledConnection*> m_queue;
+    bool m_stopping = false;
+};
+
+class PGSQLConnectionPool {
+private:
+    // Idle connections live in a set of independently locked stacks. A
+    // thread checks out from and releases to its own shard and only steals
+    // from the others when that one is empty, so neither path needs a
+    // pool-wide lock.
+    struct FreeListShard {
+        Mutex m_lock;
+        std::vector<PGSQLPooledConnection*> m_connections;
+        std::atomic<int> m_size{0};
+        // Keep neighbouring shards off the same cache line.
+        char m_padding[64];
+    };
+
+    PGSQLConnectionPoolOptions m_options;
+    Mutex m_lock; // Guards m_connections and m_cleanedConnectionString
+    std::string m_connectionString;
+    std::string m_cleanedConnectionString;
+    std::vector<PGSQLPooledConnection*> m_connections;
+
+    size_t m_shardCount;
+    std::unique_ptr<FreeListShard[]> m_shards;
+
+    std::atomic<int> m_totalConnections{0};
+    std::atomic<int> m_freeConnections{0};
+    std::atomic<int> m_checkedOutConnections{0};
+    // Open connections plus those being opened, checked against the limit
+    std::atomic<int> m_slots{0};
+
+    // Checkouts waiting for a connection, in arrival order. Release() hands
+    // connections straight to the front waiter under m_waitLock. Nobody
+    // takes that lock while no one is waiting.
+    struct Waiter {
+        std::condition_variable m_cond;
+        PGSQLPooledConnection* m_connection = nullptr;
+        bool m_slotFreed = false;
+    };
+
+    std::mutex m_waitLock;
+    std::deque<Waiter*> m_waiters;
+    std::atomic<int> m_waiterCount{0};
+
+    std::atomic<long> m_sweepedConnections{0};
+    std::atomic<long> m_openedConnections{0};
+    std::atomic<long> m_requestedConnections{0};
+    std::atomic<long> m_releasedConnections{0};
+    std::atomic<long> m_errors{0};
+    std::atomic<long> m_waitedConnections{0};
+    std::atomic<long> m_waitTimeouts{0};
+    std::atomic<long> m_waitTime{0};
+    std::atomic<int> m_cleaningConnections{0};
+    std::atomic<long> m_cleanedConnections{0};
+
+    // All in microseconds
+    PGSQLStats::Histogram m_checkoutTimes;
+    PGSQLStats::Histogram m_connectTimes;
+    PGSQLStats::Histogram m_useTimes;
+    PGSQLStats::Histogram m_connectionAges;
+
+    std::thread m_maintenanceThread;
+    std::mutex m_maintenanceLock;
+    std::condition_variable m_maintenanceCond;
+    bool m_maintenanceStopping = false;
+    bool m_maintenanceWakeup = false;
+
+    PGSQLConnectionCleaner m_cleaner;
+
+    size_t HomeShard() const;
+    PGSQLPooledConnection* PopFreeConnection();
+    void PushFreeConnection(PGSQLPooledConnection* connection);
+    void PushFreeConnection(PGSQLPooledConnection* connection, size_t shard);
+    void AddConnection(PGSQLPooledConnection* connection);
+    void SweepConnection(PGSQLPooledConnection* connection);
+
+    PGSQLPooledConnection* CheckoutConnection(PGSQLCheckoutFailure& failure);
+    bool ReserveSlot();
+    void ReleaseSlot();
+    PGSQLPooledConnection* OpenConnection(PGSQLCheckoutFailure& failure);
+    PGSQLPooledConnection* WaitForConnection(bool& slotReserved, PGSQLCheckoutFailure& failure);
+    void HandOffToWaiters();
+
+    bool ProbeConnection(PGSQLPooledConnection* connection);
+    bool CleanConnection(PGSQLPooledConnection* connection);
+    void ReapConnections();
+    void MaintenanceLoop();
+    void WakeMaintenance();
+
+public:
+    static int ShardCount;
+
+    long SweepedConnections() const { return m_sweepedConnections.load(); }
+    long OpenedConnections() const { return m_openedConnections.load(); }
+    long RequestedConnections() const { return m_requestedConnections.load(); }
+    long ReleasedConnections() const { return m_releasedConnections.load(); }
+    long Errors() const { return m_errors.load(); }
+    long WaitedConnections() const { return m_waitedConnections.load(); }
+    long WaitTimeouts() const { return m_waitTimeouts.load(); }
+    // Total time checkouts have spent queueing, in microseconds
+    long WaitTime() const { return m_waitTime.load(); }
+    int WaitingCount() const { return m_waiterCount.load(); }
+    int CleaningCount() const { return m_cleaningConnections.load(); }
+    long CleanedConnections() const { return m_cleanedConnections.load(); }
+
+    // Time spent in GetConnection(), including any wait or connect
+    const PGSQLStats::Histogram& CheckoutTimes() const { return m_checkoutTimes; }
+    // Time taken to establish each new connection
+    const PGSQLStats::Histogram& ConnectTimes() const { return m_connectTimes; }
+    // Time from checkout to release
+    const PGSQLStats::Histogram& UseTimes() const { return m_useTimes; }
+    // Age of connections when they are closed
+    const PGSQLStats::Histogram& ConnectionAges() const { return m_connectionAges; }
+
+    int TotalConnectionsCount() const { return m_totalConnections.load(); }
+    int FreeConnectionsCount() const { return m_freeConnections.load(); }
+    int CheckedOutConnectionsCount() const { return m_checkedOutConnections.load(); }
+
+    PGSQLConnectionPool(std::string connectionString,
+        const PGSQLConnectionPoolOptions& options = PGSQLConnectionPoolOptions());
+    ~PGSQLConnectionPool();
+
+    PQ::Connection& GetConnection();
+    PQ::Connection* TryGetConnection(PGSQLCheckoutFailure& failure);
+    PQ::Connection* TryGetIdleConnection();
+    // dropStatements has the cleaner run CLOSE ALL and DEALLOCATE ALL once
+    // the connection has been drained and rolled back
+    void Release(PQ::Connection& connection, bool dropStatements = false);
+
+    std::string GetConnectionString() const { return m_connectionString; }
+    std::string GetCleanedConnectionString();
+
+    void CloseAllConnections();
+    void CloseFreeConnections();
+    int MaximumConnections() const { return m_options.MaximumConnections; }
+    int MinIdle() const { return m_options.MinIdle; }
+
+    int OpenConnections(int count);
+    void FillMinIdle();
+
+    void StartMaintenance();
+    void StopMaintenance();
+
+    void FinishCleaning(PGSQLPooledConnection* connection);
+    // Cleans whatever has been released so far, then stops the cleaner
+    void StopCleaning() { m_cleaner.Stop(); }
+
+    friend class PGSQLConnectionCleaner;
+};
+
+// A primary and its replicas, declared in the PGSQL.Clusters section. Each
+// host has a pool of its own. Reads go to the replica with the fewest
+// checked out connections per unit of weight, writes to the primary. A
+// host that fails to connect is left out for EjectSeconds.
+class PGSQLConnectionCluster {
+public:
+    explicit PGSQLConnectionCluster(int ejectSeconds)
+        : m_ejectSeconds(ejectSeconds) {}
+
+    void AddHost(PGSQLConnectionPool& pool, bool primary, int weight);
+
+    // Returns nullptr with `failure` set when no host could provide one.
+    PQ::Connection* GetConnection(bool readOnly, PGSQLConnectionPool*& pool,
+            PGSQLCheckoutFailure& failure);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Host {
+        PGSQLConnectionPool* m_pool;
+        bool m_primary;
+        int m_weight;
+        // Clock ticks until which the host is out of rotation
+        std::atomic<Clock::rep> m_ejectedUntil{0};
+    };
+
+    bool TryHost(Host& host, Clock::rep now, PQ::Connection*& conn,
+            PGSQLCheckoutFailure& failure);
+
+    std::vector<std::unique_ptr<Host>> m_hosts;
+    int m_ejectSeconds;
+};
+
+extern PGSQLConnectionPoolContainer s_connectionPoolContainer;
+
+// Filled in by moduleLoad and never changed afterwards, so read without a lock
+extern std::unordered_map<std::string, std::unique_ptr<PGSQLConnectionCluster>> s_connectionClusters;
+
+}
+
+#endif//_INCL_PGSQL_CONNECTION_POOL_H
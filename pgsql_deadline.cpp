@@ -0,0 +1,181 @@
+#include "pgsql_deadline.h"
+
+#include "hphp/runtime/base/thread-info.h"
+
+#include <cstring>
+
+namespace HPHP {
+
+PGSQLDeadlineTimer s_deadlineTimer;
+
+int PGSQLQueryDeadline::DefaultTimeoutMs = 0;
+
+// The server reports a cancelled query as query_canceled
+static const char *QueryCanceledState = "57014";
+
+// Milliseconds until HHVM times out the current request, or 0 if it has no
+// limit. The request can only be stopped once a query returns, so a query
+// running past this would go on holding a backend for a request that is
+// already dead.
+static int request_time_left_ms()
+{
+    auto& data = ThreadInfo::s_threadInfo->m_reqInjectionData;
+
+    if (data.getTimeout() <= 0)
+        return 0;
+
+    // Whole seconds, so a query may overrun by up to one
+    int left = data.getRemainingTime();
+    return (left > 0 ? left : 1) * 1000;
+}
+
+void PGSQLRequestDeadline::Arm(PQ::Connection& conn, int timeLeftMs)
+{
+    auto now = PGSQLDeadlineTimer::Clock::now();
+    auto at = now + std::chrono::milliseconds(timeLeftMs);
+
+    if (m_id && m_at > now && m_canceller == conn.canceller() &&
+        at > m_at - std::chrono::seconds(1) && at < m_at + std::chrono::seconds(1))
+        return;
+
+    Disarm();
+
+    m_canceller = conn.canceller();
+    m_id = s_deadlineTimer.Arm(m_canceller, timeLeftMs);
+    m_at = at;
+}
+
+PGSQLQueryDeadline::PGSQLQueryDeadline(PQ::Connection& conn, PGSQLRequestDeadline& request,
+        int timeoutMs)
+{
+    int requestMs = request_time_left_ms();
+    if (requestMs > 0 && (timeoutMs <= 0 || requestMs <= timeoutMs))
+    {
+        request.Arm(conn, requestMs);
+        m_request = &request;
+    }
+    else if (timeoutMs > 0)
+    {
+        m_id = s_deadlineTimer.Arm(conn.canceller(), timeoutMs);
+    }
+}
+
+bool PGSQLQueryDeadline::Cancelled(PQ::Result& res)
+{
+    bool expired = Expired();
+
+    if (!res || res.status() != PGRES_FATAL_ERROR)
+        return false;
+
+    const char *state = res.errorField(PG_DIAG_SQLSTATE);
+    if (state == nullptr || strcmp(state, QueryCanceledState) != 0)
+        return false;
+
+    return expired || (m_request && m_request->Fired());
+}
+
+uint64_t PGSQLDeadlineTimer::Arm(std::shared_ptr<PQ::Canceller> canceller, int timeoutMs)
+{
+    Deadline deadline;
+    deadline.m_at = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    deadline.m_canceller = std::move(canceller);
+
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    if (m_stopping)
+        return 0;
+
+    if (!m_thread.joinable())
+        m_thread = std::thread([this] { Run(); });
+
+    uint64_t id = m_nextId++;
+    m_queue.emplace(deadline.m_at, id);
+
+    // Only an earlier deadline changes how long the thread sleeps
+    if (m_queue.begin()->second == id)
+        m_cond.notify_one();
+
+    m_deadlines.emplace(id, std::move(deadline));
+
+    return id;
+}
+
+bool PGSQLDeadlineTimer::Disarm(uint64_t id)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    m_cancelled.wait(lock, [this, id] { return m_cancelling != id; });
+
+    auto it = m_deadlines.find(id);
+    if (it != m_deadlines.end())
+    {
+        m_queue.erase(std::make_pair(it->second.m_at, id));
+        m_deadlines.erase(it);
+        return false;
+    }
+
+    return m_fired.erase(id) > 0;
+}
+
+bool PGSQLDeadlineTimer::Fired(uint64_t id)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    m_cancelled.wait(lock, [this, id] { return m_cancelling != id; });
+
+    return m_fired.count(id) > 0;
+}
+
+void PGSQLDeadlineTimer::Run()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (!m_stopping)
+    {
+        if (m_queue.empty())
+        {
+            m_cond.wait(lock);
+            continue;
+        }
+
+        auto next = *m_queue.begin();
+        if (Clock::now() < next.first)
+        {
+            m_cond.wait_until(lock, next.first);
+            continue;
+        }
+
+        m_queue.erase(m_queue.begin());
+
+        auto it = m_deadlines.find(next.second);
+        std::shared_ptr<PQ::Canceller> canceller = std::move(it->second.m_canceller);
+        m_deadlines.erase(it);
+
+        m_fired.insert(next.second);
+        m_cancelling = next.second;
+
+        // Sending the cancel connects to the server, so don't hold up
+        // everyone else meanwhile
+        lock.unlock();
+        canceller->cancel();
+        lock.lock();
+
+        m_cancelling = 0;
+        m_cancelled.notify_all();
+    }
+}
+
+void PGSQLDeadlineTimer::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+
+        m_stopping = true;
+        m_cond.notify_one();
+    }
+
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+}
@@ -0,0 +1,141 @@
+#ifndef _INCL_PGSQL_DEADLINE_H
+#define _INCL_PGSQL_DEADLINE_H
+
+#include "pq.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+
+// Client-side query timeouts for pg_query and friends and PDO statements.
+
+namespace HPHP {
+
+// Cancels queries that outlive their deadline. One thread sleeps until the
+// earliest deadline, so a query that finishes in time costs a lock and a
+// map entry, and only an expired one a round trip to the server.
+class PGSQLDeadlineTimer {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    ~PGSQLDeadlineTimer() { Stop(); }
+
+    // Cancels whatever query canceller's connection is running unless
+    // Disarm() is called within timeoutMs. Returns the id to disarm it with.
+    uint64_t Arm(std::shared_ptr<PQ::Canceller> canceller, int timeoutMs);
+
+    // Returns whether the deadline passed and the cancel was sent. Once this
+    // returns, the cancel can't reach a later query.
+    bool Disarm(uint64_t id);
+
+    // Whether the deadline has passed and the cancel been sent, leaving it
+    // to be disarmed later
+    bool Fired(uint64_t id);
+
+    void Stop();
+
+private:
+    void Run();
+
+    struct Deadline {
+        Clock::time_point m_at;
+        std::shared_ptr<PQ::Canceller> m_canceller;
+    };
+
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;      // Wakes the timer thread
+    std::condition_variable m_cancelled; // Wakes Disarm() after a cancel
+
+    std::map<uint64_t, Deadline> m_deadlines;
+    std::set<std::pair<Clock::time_point, uint64_t>> m_queue; // Earliest first
+    std::unordered_set<uint64_t> m_fired;
+    uint64_t m_cancelling = 0; // Being sent, 0 if none
+    uint64_t m_nextId = 1;
+    bool m_stopping = false;
+};
+
+extern PGSQLDeadlineTimer s_deadlineTimer;
+
+// Cancels a connection's query once the request using it runs out of time.
+// It is armed by the first query the request's time limit applies to and
+// stays armed for those after, so they cost no more than a look at the
+// clock. It must be disarmed before the connection is closed or handed to
+// another request.
+class PGSQLRequestDeadline {
+public:
+    ~PGSQLRequestDeadline() { Disarm(); }
+
+    PGSQLRequestDeadline() = default;
+    PGSQLRequestDeadline(const PGSQLRequestDeadline&) = delete;
+    PGSQLRequestDeadline& operator=(const PGSQLRequestDeadline&) = delete;
+
+    // Re-arms only if the connection was reset, the deadline has passed, or
+    // the time limit moved by more than the second it is measured in
+    void Arm(PQ::Connection& conn, int timeLeftMs);
+
+    bool Fired() { return m_id && s_deadlineTimer.Fired(m_id); }
+
+    void Disarm() {
+        if (m_id) {
+            s_deadlineTimer.Disarm(m_id);
+            m_id = 0;
+            m_canceller.reset();
+        }
+    }
+
+private:
+    uint64_t m_id = 0;
+    PGSQLDeadlineTimer::Clock::time_point m_at;
+    std::shared_ptr<PQ::Canceller> m_canceller;
+};
+
+// Keeps a deadline on the queries run while it's in scope. Nothing is armed
+// for a timeout of 0 or less when the request has no time limit.
+class PGSQLQueryDeadline {
+public:
+    // PGSQL.QueryTimeoutMs, in milliseconds; 0 for none
+    static int DefaultTimeoutMs;
+
+    // If the request's time limit runs out first, request is armed instead
+    // and left armed once the query is done
+    PGSQLQueryDeadline(PQ::Connection& conn, PGSQLRequestDeadline& request, int timeoutMs);
+
+    ~PGSQLQueryDeadline() { Disarm(); }
+
+    PGSQLQueryDeadline(const PGSQLQueryDeadline&) = delete;
+    PGSQLQueryDeadline& operator=(const PGSQLQueryDeadline&) = delete;
+
+    // Whether the query was cancelled for running out of time. Ends the
+    // deadline.
+    bool Expired() {
+        Disarm();
+        return m_expired;
+    }
+
+    // Whether res is the error of a query the deadline cancelled
+    bool Cancelled(PQ::Result& res);
+
+private:
+    void Disarm() {
+        if (m_id) {
+            m_expired = s_deadlineTimer.Disarm(m_id);
+            m_id = 0;
+        }
+    }
+
+    uint64_t m_id = 0;
+    bool m_expired = false;
+    PGSQLRequestDeadline* m_request = nullptr;
+};
+
+}
+
+#endif//_INCL_PGSQL_DEADLINE_H
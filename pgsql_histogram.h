@@ -0,0 +1,115 @@
+#ifndef _INCL_PGSQL_HISTOGRAM_H
+#define _INCL_PGSQL_HISTOGRAM_H
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+namespace PGSQLStats {
+
+// A log-linear histogram in the style of HdrHistogram. Each power of two is
+// split into 16 equal sub-buckets, so any recorded value is reported to
+// within about 6% of its true value. Recording only touches atomics and can
+// happen from any thread; reads are not a consistent snapshot, which is fine
+// for reporting.
+class Histogram {
+public:
+    static const int SubBucketBits = 4;
+    static const int SubBuckets = 1 << SubBucketBits;
+    static const int BucketCount = SubBuckets + (64 - SubBucketBits) * SubBuckets;
+
+    Histogram() {
+        for (auto& count : m_counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(int64_t value) {
+        if (value < 0) value = 0;
+
+        m_counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        int64_t min = m_min.load(std::memory_order_relaxed);
+        while (value < min &&
+               !m_min.compare_exchange_weak(min, value, std::memory_order_relaxed)) {}
+
+        int64_t max = m_max.load(std::memory_order_relaxed);
+        while (value > max &&
+               !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    int64_t count() const { return m_count.load(std::memory_order_relaxed); }
+    int64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+
+    int64_t min() const {
+        return count() ? m_min.load(std::memory_order_relaxed) : 0;
+    }
+
+    int64_t max() const { return m_max.load(std::memory_order_relaxed); }
+
+    int64_t mean() const {
+        int64_t n = count();
+        return n ? sum() / n : 0;
+    }
+
+    // Smallest recorded value that `percentile` percent of values are at or
+    // below, reported as the upper bound of its bucket.
+    int64_t percentile(double percentile) const {
+        int64_t total = 0;
+        for (auto& count : m_counts) {
+            total += count.load(std::memory_order_relaxed);
+        }
+
+        if (total == 0) return 0;
+
+        int64_t target = (int64_t)(percentile / 100.0 * total + 0.5);
+        if (target < 1) target = 1;
+
+        int64_t seen = 0;
+        for (int i = 0; i < BucketCount; i++) {
+            seen += m_counts[i].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                int64_t upper = highestEquivalent(i);
+                int64_t max = this->max();
+                return upper < max ? upper : max;
+            }
+        }
+
+        return max();
+    }
+
+private:
+    static int index(int64_t value) {
+        if (value < SubBuckets) return (int)value;
+
+        int msb = 63 - __builtin_clzll((uint64_t)value);
+        int shift = msb - SubBucketBits;
+        int top = (int)(value >> shift); // In [SubBuckets, 2 * SubBuckets)
+
+        return SubBuckets + shift * SubBuckets + (top - SubBuckets);
+    }
+
+    static int64_t highestEquivalent(int index) {
+        if (index < SubBuckets) return index;
+
+        int shift = (index - SubBuckets) / SubBuckets;
+        int64_t top = SubBuckets + (index - SubBuckets) % SubBuckets;
+
+        return ((top + 1) << shift) - 1;
+    }
+
+    std::atomic<int64_t> m_counts[BucketCount];
+    std::atomic<int64_t> m_count{0};
+    std::atomic<int64_t> m_sum{0};
+    std::atomic<int64_t> m_min{std::numeric_limits<int64_t>::max()};
+    std::atomic<int64_t> m_max{0};
+};
+
+}
+
+#endif//_INCL_PGSQL_HISTOGRAM_H
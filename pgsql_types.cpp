@@ -0,0 +1,422 @@
+#include "pgsql_types.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace HPHP {
+
+// Binary values are sent most significant byte first
+static uint64_t read_be(const char *data, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | (unsigned char)data[i];
+    }
+    return value;
+}
+
+// Dates and timestamps count from 2000-01-01, 10957 days after the Unix
+// epoch
+static const int64_t PostgresEpochDays = 10957;
+static const int64_t MicrosPerDay = 86400LL * 1000000LL;
+
+// Proleptic Gregorian calendar date of a day number relative to the Unix
+// epoch, from Howard Hinnant's civil_from_days
+static void civil_from_days(int64_t z, int64_t& year, int& month, int& day) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    int64_t doe = z - era * 146097;
+    int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int64_t mp = (5 * doy + 2) / 153;
+
+    day = (int)(doy - (153 * mp + 2) / 5 + 1);
+    month = (int)(mp < 10 ? mp + 3 : mp - 9);
+    year = yoe + era * 400 + (month <= 2);
+}
+
+// Appends the date in the server's ISO DateStyle, returning whether it's
+// BC. There is no year 0: 1 BC precedes 1 AD.
+static bool append_date(std::string& out, int64_t pgDays) {
+    int64_t year;
+    int month, day;
+    civil_from_days(pgDays + PostgresEpochDays, year, month, day);
+
+    bool bc = year <= 0;
+    if (bc) year = 1 - year;
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%04lld-%02d-%02d", (long long)year, month, day);
+    out += buf;
+
+    return bc;
+}
+
+static String decode_date(const char *data) {
+    int32_t days = (int32_t)read_be(data, 4);
+
+    if (days == std::numeric_limits<int32_t>::max()) return String("infinity");
+    if (days == std::numeric_limits<int32_t>::min()) return String("-infinity");
+
+    std::string out;
+    if (append_date(out, days)) out += " BC";
+
+    return String(out);
+}
+
+static String decode_timestamp(const char *data, bool withZone) {
+    int64_t micros = (int64_t)read_be(data, 8);
+
+    if (micros == std::numeric_limits<int64_t>::max()) return String("infinity");
+    if (micros == std::numeric_limits<int64_t>::min()) return String("-infinity");
+
+    int64_t days = micros / MicrosPerDay;
+    int64_t rem = micros % MicrosPerDay;
+    if (rem < 0) {
+        days--;
+        rem += MicrosPerDay;
+    }
+
+    std::string out;
+    bool bc = append_date(out, days);
+
+    int64_t secs = rem / 1000000;
+    int fraction = (int)(rem % 1000000);
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), " %02d:%02d:%02d",
+             (int)(secs / 3600), (int)(secs / 60 % 60), (int)(secs % 60));
+    out += buf;
+
+    if (fraction) {
+        snprintf(buf, sizeof(buf), ".%06d", fraction);
+        size_t len = strlen(buf);
+        while (buf[len - 1] == '0') len--;
+        out.append(buf, len);
+    }
+
+    if (withZone) out += "+00";
+    if (bc) out += " BC";
+
+    return String(out);
+}
+
+static String decode_uuid(const char *data) {
+    static const char hex[] = "0123456789abcdef";
+
+    char buf[36];
+    int pos = 0;
+
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) buf[pos++] = '-';
+        buf[pos++] = hex[(unsigned char)data[i] >> 4];
+        buf[pos++] = hex[(unsigned char)data[i] & 0xf];
+    }
+
+    return String(buf, sizeof(buf), CopyString);
+}
+
+static Variant raw_string(const char *data, int length) {
+    return String(data, length, CopyString);
+}
+
+static Variant binary_bool(const char *data, int length) {
+    if (length != 1) return raw_string(data, length);
+    return data[0] != 0;
+}
+
+static Variant binary_int2(const char *data, int length) {
+    if (length != 2) return raw_string(data, length);
+    return (int64_t)(int16_t)read_be(data, 2);
+}
+
+static Variant binary_int4(const char *data, int length) {
+    if (length != 4) return raw_string(data, length);
+    return (int64_t)(int32_t)read_be(data, 4);
+}
+
+static Variant binary_oid(const char *data, int length) {
+    if (length != 4) return raw_string(data, length);
+    return (int64_t)(uint32_t)read_be(data, 4);
+}
+
+static Variant binary_int8(const char *data, int length) {
+    if (length != 8) return raw_string(data, length);
+    return (int64_t)read_be(data, 8);
+}
+
+static Variant binary_float4(const char *data, int length) {
+    if (length != 4) return raw_string(data, length);
+
+    uint32_t bits = (uint32_t)read_be(data, 4);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return (double)value;
+}
+
+static Variant binary_float8(const char *data, int length) {
+    if (length != 8) return raw_string(data, length);
+
+    uint64_t bits = read_be(data, 8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static Variant binary_date(const char *data, int length) {
+    if (length != 4) return raw_string(data, length);
+    return decode_date(data);
+}
+
+static Variant binary_timestamp(const char *data, int length) {
+    if (length != 8) return raw_string(data, length);
+    return decode_timestamp(data, false);
+}
+
+static Variant binary_timestamptz(const char *data, int length) {
+    if (length != 8) return raw_string(data, length);
+    return decode_timestamp(data, true);
+}
+
+static Variant binary_uuid(const char *data, int length) {
+    if (length != 16) return raw_string(data, length);
+    return decode_uuid(data);
+}
+
+// A version byte, then the JSON text
+static Variant binary_jsonb(const char *data, int length) {
+    if (length < 1 || data[0] != 1) return raw_string(data, length);
+    return String(data + 1, length - 1, CopyString);
+}
+
+// Text values are always null terminated
+static Variant text_int(const char *data, int /*length*/) {
+    return (int64_t)strtoll(data, nullptr, 10);
+}
+
+// strtod() takes the server's NaN, Infinity and -Infinity as well
+static Variant text_float(const char *data, int /*length*/) {
+    return strtod(data, nullptr);
+}
+
+static Variant text_bool(const char *data, int /*length*/) {
+    return data[0] == 't';
+}
+
+PGSQLConverter pgsql_binary_converter(Oid type) {
+    switch (type) {
+        case PGSQL_BOOLOID:        return binary_bool;
+        case PGSQL_INT2OID:        return binary_int2;
+        case PGSQL_INT4OID:        return binary_int4;
+        case PGSQL_OIDOID:         return binary_oid;
+        case PGSQL_INT8OID:        return binary_int8;
+        case PGSQL_FLOAT4OID:      return binary_float4;
+        case PGSQL_FLOAT8OID:      return binary_float8;
+        case PGSQL_DATEOID:        return binary_date;
+        case PGSQL_TIMESTAMPOID:   return binary_timestamp;
+        case PGSQL_TIMESTAMPTZOID: return binary_timestamptz;
+        case PGSQL_UUIDOID:        return binary_uuid;
+        case PGSQL_JSONBOID:       return binary_jsonb;
+        // Sent as they are
+        case PGSQL_BYTEAOID:
+        case PGSQL_CHAROID:
+        case PGSQL_NAMEOID:
+        case PGSQL_TEXTOID:
+        case PGSQL_JSONOID:
+        case PGSQL_BPCHAROID:
+        case PGSQL_VARCHAROID:
+            return raw_string;
+        default:
+            return nullptr;
+    }
+}
+
+PGSQLConverter pgsql_text_converter(Oid type, PGSQLNumericMode numericMode) {
+    switch (type) {
+        case PGSQL_BOOLOID:
+            return text_bool;
+        case PGSQL_INT2OID:
+        case PGSQL_INT4OID:
+        case PGSQL_INT8OID:
+        case PGSQL_OIDOID:
+            return text_int;
+        case PGSQL_FLOAT4OID:
+        case PGSQL_FLOAT8OID:
+            return text_float;
+        case PGSQL_NUMERICOID:
+            return numericMode == PGSQL_NUMERIC_FLOAT ? text_float : nullptr;
+        default:
+            return nullptr;
+    }
+}
+
+bool pgsql_binary_decodable(PQ::Result& res) {
+    for (int i = 0; i < res.numFields(); i++) {
+        if (pgsql_binary_converter(res.type(i)) == nullptr) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int write_be(char *buf, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        buf[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+    return bytes;
+}
+
+int pgsql_encode_binary(Oid type, const Variant& value, char *buf) {
+    switch (type) {
+        case PGSQL_BOOLOID:
+            if (!value.isBoolean()) break;
+            buf[0] = value.toBoolean() ? 1 : 0;
+            return 1;
+        case PGSQL_INT2OID:
+        case PGSQL_INT4OID:
+        case PGSQL_INT8OID: {
+            if (!value.isInteger()) break;
+
+            int64_t n = value.toInt64();
+            // Out of range values go as text for the server to reject
+            if (type == PGSQL_INT2OID) {
+                if (n < INT16_MIN || n > INT16_MAX) break;
+                return write_be(buf, (uint64_t)n, 2);
+            }
+            if (type == PGSQL_INT4OID) {
+                if (n < INT32_MIN || n > INT32_MAX) break;
+                return write_be(buf, (uint64_t)n, 4);
+            }
+            return write_be(buf, (uint64_t)n, 8);
+        }
+        case PGSQL_FLOAT4OID: {
+            if (!value.isDouble() && !value.isInteger()) break;
+
+            float f = (float)value.toDouble();
+            uint32_t bits;
+            memcpy(&bits, &f, sizeof(bits));
+            return write_be(buf, bits, 4);
+        }
+        case PGSQL_FLOAT8OID: {
+            if (!value.isDouble() && !value.isInteger()) break;
+
+            double d = value.toDouble();
+            uint64_t bits;
+            memcpy(&bits, &d, sizeof(bits));
+            return write_be(buf, bits, 8);
+        }
+        default:
+            break;
+    }
+
+    return -1;
+}
+
+bool pgsql_has_binary_encoder(Oid type) {
+    switch (type) {
+        case PGSQL_BOOLOID:
+        case PGSQL_INT2OID:
+        case PGSQL_INT4OID:
+        case PGSQL_INT8OID:
+        case PGSQL_FLOAT4OID:
+        case PGSQL_FLOAT8OID:
+        case PGSQL_BYTEAOID:
+        case PGSQL_CHAROID:
+        case PGSQL_NAMEOID:
+        case PGSQL_TEXTOID:
+        case PGSQL_JSONOID:
+        case PGSQL_BPCHAROID:
+        case PGSQL_VARCHAROID:
+        case PGSQL_JSONBOID:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Reads an integer as the server would: an optional sign and digits, with
+// surrounding whitespace. "1.5" and "1e3" aren't integers.
+static bool parse_integer(const String& str, int64_t& out) {
+    const char *start = str.data();
+    char *end;
+
+    errno = 0;
+    long long n = strtoll(start, &end, 10);
+    if (end == start || errno == ERANGE) return false;
+
+    while (isspace((unsigned char)*end)) end++;
+    if (end != start + str.size()) return false;
+
+    out = n;
+    return true;
+}
+
+bool pgsql_append_binary(std::string& out, Oid type, const Variant& value) {
+    Variant converted;
+
+    switch (type) {
+        case PGSQL_BOOLOID:
+            if (value.isBoolean() || value.isInteger()) {
+                converted = value.toBoolean();
+            } else if (value.isString() && value.toString().size() > 0) {
+                // The server's spellings: t, true, 1 and f, false, 0
+                char c = value.toString().data()[0];
+                if (c == 't' || c == 'T' || c == '1') converted = true;
+                else if (c == 'f' || c == 'F' || c == '0') converted = false;
+                else return false;
+            } else {
+                return false;
+            }
+            break;
+        case PGSQL_INT2OID:
+        case PGSQL_INT4OID:
+        case PGSQL_INT8OID:
+            if (value.isInteger()) {
+                converted = value.toInt64();
+            } else if (value.isString()) {
+                int64_t n;
+                if (!parse_integer(value.toString(), n)) return false;
+                converted = n;
+            } else if (value.isDouble()) {
+                // Only whole numbers; anything else would be truncated
+                double d = value.toDouble();
+                if (d != std::floor(d) || d < -9.2233720368547758e18 ||
+                    d >= 9.2233720368547758e18) return false;
+                converted = (int64_t)d;
+            } else {
+                return false;
+            }
+            break;
+        case PGSQL_FLOAT4OID:
+        case PGSQL_FLOAT8OID:
+            if (!value.isDouble() && !value.isInteger() && !value.isNumeric(true)) return false;
+            converted = value.toDouble();
+            break;
+        case PGSQL_JSONBOID:
+            out += '\1';
+            // Fall through
+        default: {
+            if (!pgsql_has_binary_encoder(type)) return false;
+
+            String str = value.toString();
+            out.append(str.data(), str.size());
+            return true;
+        }
+    }
+
+    char buf[8];
+    int length = pgsql_encode_binary(type, converted, buf);
+    if (length < 0) return false;
+
+    out.append(buf, length);
+    return true;
+}
+
+}
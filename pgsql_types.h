@@ -0,0 +1,79 @@
+#ifndef _INCL_PGSQL_TYPES_H
+#define _INCL_PGSQL_TYPES_H
+
+#include "pq.h"
+
+#include "hphp/runtime/base/base-includes.h"
+
+#include <string>
+
+// Conversion of column values in PostgreSQL's wire formats to PHP values.
+
+namespace HPHP {
+
+// Type OIDs from the server's pg_type.h, which libpq doesn't install
+enum PGSQLTypeOid : Oid {
+    PGSQL_BOOLOID = 16,
+    PGSQL_BYTEAOID = 17,
+    PGSQL_CHAROID = 18,
+    PGSQL_NAMEOID = 19,
+    PGSQL_INT8OID = 20,
+    PGSQL_INT2OID = 21,
+    PGSQL_INT4OID = 23,
+    PGSQL_TEXTOID = 25,
+    PGSQL_OIDOID = 26,
+    PGSQL_JSONOID = 114,
+    PGSQL_FLOAT4OID = 700,
+    PGSQL_FLOAT8OID = 701,
+    PGSQL_BPCHAROID = 1042,
+    PGSQL_VARCHAROID = 1043,
+    PGSQL_DATEOID = 1082,
+    PGSQL_TIMESTAMPOID = 1114,
+    PGSQL_TIMESTAMPTZOID = 1184,
+    PGSQL_NUMERICOID = 1700,
+    PGSQL_UUIDOID = 2950,
+    PGSQL_JSONBOID = 3802,
+};
+
+// How typed fetches return numeric columns, which a PHP float can't hold
+// exactly
+enum PGSQLNumericMode {
+    PGSQL_NUMERIC_STRING = 0,
+    PGSQL_NUMERIC_FLOAT = 1,
+};
+
+// Turns one non-null column value, as received from the server, into a PHP
+// value. Results look their converters up once per column.
+typedef Variant (*PGSQLConverter)(const char *data, int length);
+
+// Converter for values of the type in binary format, or null if the type
+// can't be read in binary. Integers, floats and booleans become PHP ints,
+// floats and bools; bytea is returned as its raw bytes; dates and
+// timestamps are formatted as ISO 8601 strings, with timestamptz in UTC.
+// Values that don't match their type's binary layout are returned as raw
+// bytes.
+PGSQLConverter pgsql_binary_converter(Oid type);
+
+// Converter for typed fetches of values of the type in text format, or
+// null where the value stays a string
+PGSQLConverter pgsql_text_converter(Oid type, PGSQLNumericMode numericMode);
+
+// Whether every column of a result, or of a described statement, can be
+// read in binary format
+bool pgsql_binary_decodable(PQ::Result& res);
+
+// Encodes an int, float or bool parameter in the binary format of the type
+// the server expects, into buf, which must hold 8 bytes. Returns the
+// length, or -1 if the value should be sent as text instead.
+int pgsql_encode_binary(Oid type, const Variant& value, char *buf);
+
+// Whether COPY BINARY can send values of the type
+bool pgsql_has_binary_encoder(Oid type);
+
+// Appends a non-null value in the binary format of the type, converting
+// the PHP value to the type first. Returns false if it can't be converted.
+bool pgsql_append_binary(std::string& out, Oid type, const Variant& value);
+
+}
+
+#endif//_INCL_PGSQL_TYPES_H
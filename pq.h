@@ -1,10 +1,14 @@
 #ifndef _INCL_PQ_H
 #define _INCL_PQ_H
 
+#include <memory>
 #include <string>
 #include <iostream>
 #include <libpq-fe.h>
 #include <utility>
+#include <cerrno>
+#include <chrono>
+#include <poll.h>
 
 namespace PQ {
 
@@ -24,13 +28,25 @@ public:
     }
 
     Result& operator=(Result&& other) {
-        m_res = other.m_res;
-        other.m_res = nullptr;
+        if (this != &other) {
+            clear();
+            m_res = other.m_res;
+            other.m_res = nullptr;
+        }
         return *this;
     }
 
     ExecStatusType status() { return PQresultStatus(m_res); }
 
+    // Some of the rows of a query being read in single-row or chunked mode
+    bool isPartial() {
+        ExecStatusType st = status();
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        if (st == PGRES_TUPLES_CHUNK) return true;
+#endif
+        return st == PGRES_SINGLE_TUPLE;
+    }
+
     ~Result() {
         if (m_res) {
             PQclear(m_res);
@@ -117,6 +133,20 @@ public:
         return PQftype(m_res, column_number);
     }
 
+    // Parameters of a described statement
+    int numParams() const {
+        return PQnparams(m_res);
+    }
+
+    Oid paramType(int param_number) const {
+        return PQparamtype(m_res, param_number);
+    }
+
+    // 0 for text, 1 for binary
+    int format(int column_number) const {
+        return PQfformat(m_res, column_number);
+    }
+
     Oid oidValue() {
         return PQoidValue(m_res);
     }
@@ -128,6 +158,37 @@ private:
     PGresult *m_res;
 };
 
+// Sends cancel requests for a connection's queries. Unlike the connection,
+// it may be used from any thread.
+class Canceller {
+public:
+    explicit Canceller(PGconn *conn) : m_cancel(PQgetCancel(conn)) {}
+    ~Canceller() {
+        if (m_cancel) PQfreeCancel(m_cancel);
+    }
+
+    Canceller(const Canceller&) = delete;
+    Canceller& operator=(const Canceller&) = delete;
+
+    // Asks the server to abandon the command in progress
+    bool cancel() {
+        if (m_cancel == nullptr) return false;
+
+        char errbuf[256];
+        return PQcancel(m_cancel, errbuf, sizeof(errbuf)) == 1;
+    }
+
+private:
+    PGcancel *m_cancel;
+};
+
+// A notification sent with NOTIFY to a channel the connection LISTENs on
+struct Notification {
+    std::string channel;
+    int pid;
+    std::string payload;
+};
+
 class Connection {
 public:
     // Disable copying
@@ -143,6 +204,13 @@ public:
         m_conn = PQconnectdb(conninfo.c_str());
     }
 
+    // Begins a non-blocking connection. The connection must then be driven
+    // with connectPoll() until it reports PGRES_POLLING_OK or
+    // PGRES_POLLING_FAILED, waiting on socket() in between.
+    static Connection *start(const std::string& conninfo) {
+        return new Connection(PQconnectStart(conninfo.c_str()));
+    }
+
     ~Connection() {
         if (m_conn) {
             PQfinish(m_conn);
@@ -155,13 +223,115 @@ public:
             PQfinish(m_conn);
             m_conn = 0;
         }
+        m_canceller.reset();
     }
 
     operator bool() const {
         return (bool)m_conn;
     }
 
-    void reset() { PQreset(m_conn); }
+    void reset() {
+        // The new backend has a cancel key of its own
+        m_canceller.reset();
+        PQreset(m_conn);
+    }
+
+    PostgresPollingStatusType connectPoll() {
+        if (m_conn == nullptr) return PGRES_POLLING_FAILED;
+        return PQconnectPoll(m_conn);
+    }
+
+    int socket() const { return PQsocket(m_conn); }
+
+    // Waits up to timeoutMs milliseconds (-1 waits for ever) for the socket
+    // to become readable and/or writable. Returns false on timeout or error.
+    bool waitSocket(bool forRead, bool forWrite, int timeoutMs) {
+        struct pollfd pfd;
+        pfd.fd = PQsocket(m_conn);
+        if (pfd.fd < 0) return false;
+
+        pfd.events = (forRead ? POLLIN : 0) | (forWrite ? POLLOUT : 0);
+        pfd.revents = 0;
+
+        int ret;
+        do {
+            ret = ::poll(&pfd, 1, timeoutMs);
+        } while (ret < 0 && errno == EINTR);
+
+        return ret > 0;
+    }
+
+    // Flushes the send buffer of a non-blocking connection, reading any
+    // input that arrives meanwhile as libpq requires. Returns false on error
+    // or if the socket makes no progress for timeoutMs.
+    bool flushWait(int timeoutMs) {
+        int ret;
+        while ((ret = PQflush(m_conn)) == 1) {
+            if (!waitSocket(true, true, timeoutMs)) return false;
+            if (!PQconsumeInput(m_conn)) return false;
+        }
+        return ret == 0;
+    }
+
+    // Waits until result() can return without blocking. Returns false on
+    // error or if nothing arrives for timeoutMs.
+    bool waitResult(int timeoutMs) {
+        while (PQisBusy(m_conn)) {
+            if (!waitSocket(true, false, timeoutMs)) return false;
+            if (!PQconsumeInput(m_conn)) return false;
+        }
+        return true;
+    }
+
+    // Takes the oldest notification libpq has read, if there is one. Call
+    // consumeInput() first to read any that have arrived since.
+    bool notification(Notification& out) {
+        PGnotify *notify = PQnotifies(m_conn);
+        if (notify == nullptr) return false;
+
+        out.channel = notify->relname;
+        out.pid = notify->be_pid;
+        out.payload = notify->extra ? notify->extra : "";
+        PQfreemem(notify);
+
+        return true;
+    }
+
+    // Waits up to timeoutMs milliseconds (-1 waits for ever) for a
+    // notification and takes it. Returns false on timeout or error.
+    bool waitNotification(Notification& out, int timeoutMs) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+        while (true) {
+            if (!PQconsumeInput(m_conn)) return false;
+            if (notification(out)) return true;
+
+            int left = -1;
+            if (timeoutMs >= 0) {
+                left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0) return false;
+            }
+
+            if (!waitSocket(true, false, left)) return false;
+        }
+    }
+
+    // Like waitResult(), but gives up once timeoutMs has passed in all
+    bool waitResultFor(int timeoutMs) {
+        if (timeoutMs < 0) return waitResult(-1);
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (PQisBusy(m_conn)) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (left < 0) left = 0;
+
+            if (!waitSocket(true, false, (int)left)) return false;
+            if (!PQconsumeInput(m_conn)) return false;
+        }
+        return true;
+    }
 
     std::string db() {
         std::string val;
@@ -233,9 +403,14 @@ public:
     }
     Result exec(const std::string &cmd) { return exec(cmd.c_str()); }
 
-    Result exec(const char *command, int nParams, const char * const *paramValues) {
-        PGresult *res = PQexecParams(m_conn, command, nParams, nullptr,
-                paramValues, nullptr, nullptr, 0);
+    Result exec(const char *command, int nParams, const char * const *paramValues, int resultFormat = 0) {
+        return exec(command, nParams, nullptr, paramValues, nullptr, nullptr, resultFormat);
+    }
+
+    Result exec(const char *command, int nParams, const Oid *paramTypes, const char * const *paramValues,
+                const int *paramLengths, const int *paramFormats, int resultFormat = 0) {
+        PGresult *res = PQexecParams(m_conn, command, nParams, paramTypes,
+                paramValues, paramLengths, paramFormats, resultFormat);
         return Result(res);
     }
 
@@ -252,12 +427,16 @@ public:
         return execPrepared(name, nParams, paramValues, nullptr, nullptr);
     }
 
-    Result execPrepared(const char *name, int nParams, const char * const *paramValues, const int *paramLengths, const int *paramFormats){
-        PGresult *res = PQexecPrepared(m_conn, name, nParams, paramValues, paramLengths, paramFormats, 0);
+    Result execPrepared(const char *name, int nParams, const char * const *paramValues, const int *paramLengths, const int *paramFormats, int resultFormat = 0){
+        PGresult *res = PQexecPrepared(m_conn, name, nParams, paramValues, paramLengths, paramFormats, resultFormat);
         return Result(res);
 
     }
 
+    Result describePrepared(const char *name) {
+        return Result(PQdescribePrepared(m_conn, name));
+    }
+
     bool sendQuery(const char *query) {
         return (bool)PQsendQuery(m_conn, query);
     }
@@ -275,16 +454,49 @@ public:
         return (bool)PQsendQueryPrepared(m_conn, name, nParams, paramValues, nullptr, nullptr, 0);
     }
 
+    bool sendQueryPrepared(const char *name, int nParams, const char * const *paramValues, const int *paramLengths, const int *paramFormats, int resultFormat = 0) {
+        return (bool)PQsendQueryPrepared(m_conn, name, nParams, paramValues, paramLengths, paramFormats, resultFormat);
+    }
+
+    // Has the rows of the query just sent delivered chunkSize at a time
+    // where libpq supports it, and one at a time otherwise. Must be called
+    // before the first result() call.
+    bool setStreaming(int chunkSize = 1) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+        if (chunkSize > 1) return PQsetChunkedRowsMode(m_conn, chunkSize) == 1;
+#else
+        (void)chunkSize;
+#endif
+        return PQsetSingleRowMode(m_conn) == 1;
+    }
+
     Result result() {
         return Result(PQgetResult(m_conn));
     }
 
+    // Pipeline mode queues queries without waiting for each result. Each
+    // query's result is followed by a null result(), and each sync point
+    // by a PGRES_PIPELINE_SYNC result.
+#ifdef LIBPQ_HAS_PIPELINING
+    bool enterPipeline() { return PQenterPipelineMode(m_conn) == 1; }
+    bool exitPipeline() { return PQexitPipelineMode(m_conn) == 1; }
+    bool pipelineSync() { return PQpipelineSync(m_conn) == 1; }
+    bool inPipeline() { return PQpipelineStatus(m_conn) != PQ_PIPELINE_OFF; }
+#else
+    bool enterPipeline() { return false; }
+    bool exitPipeline() { return true; }
+    bool pipelineSync() { return false; }
+    bool inPipeline() { return false; }
+#endif
+
     bool isNonBlocking() {
         return PQisnonblocking(m_conn);
     }
 
+    // Returns false if the mode couldn't be changed, as when switching back
+    // to blocking fails to flush what's waiting to be sent
     bool setNonBlocking(bool val=true) {
-        return PQsetnonblocking(m_conn, (int)val);
+        return PQsetnonblocking(m_conn, (int)val) == 0;
     }
 
     template<typename T>
@@ -359,12 +571,55 @@ public:
         return PQflush(m_conn);
     }
 
+    // COPY FROM STDIN. On a non-blocking connection these return 0 when
+    // the data can't be queued until the socket is writable.
+    int putCopyData(const char *buffer, int nbytes) {
+        return PQputCopyData(m_conn, buffer, nbytes);
+    }
+
+    int putCopyEnd(const char *errormsg = nullptr) {
+        return PQputCopyEnd(m_conn, errormsg);
+    }
+
+    // COPY TO STDOUT, a row at a time. The row must be released with
+    // freeMem(). Returns -1 once the COPY is done and -2 on error.
+    int getCopyData(char **buffer) {
+        return PQgetCopyData(m_conn, buffer, 0);
+    }
+
+    static void freeMem(void *ptr) {
+        PQfreemem(ptr);
+    }
+
     bool cancelRequest() {
         return (bool)PQrequestCancel(m_conn);
     }
 
+    // Asks the server to abandon the command in progress. Unlike
+    // cancelRequest() this is safe to call from another thread.
+    bool cancel() {
+        return Canceller(m_conn).cancel();
+    }
+
+    // For cancelling from a thread that doesn't own the connection. Only
+    // the owning thread may call this. PQgetCancel() allocates, so one
+    // Canceller is made per backend and shared until the connection is
+    // reset or closed.
+    std::shared_ptr<Canceller> canceller() {
+        if (m_canceller) return m_canceller;
+
+        auto canceller = std::make_shared<Canceller>(m_conn);
+        // Until the handshake is over there's no cancel key to remember
+        if (status() == CONNECTION_OK) m_canceller = canceller;
+        return canceller;
+    }
+
+protected:
+    explicit Connection(PGconn *conn) : m_conn(conn) {}
+
 private:
     PGconn *m_conn;
+    std::shared_ptr<Canceller> m_canceller;
 };
 
 